@@ -1,19 +1,55 @@
+#pragma once
 
 #include <iostream>
 #include <vector>
 #include <cameraserver/CameraServer.h>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <functional>
 #include <apriltag/frc/apriltag/AprilTagDetector.h>
 #include <apriltag/frc/apriltag/AprilTagDetector_cv.h>
 #include <apriltag/frc/apriltag/AprilTagPoseEstimator.h>
+#include <networktables/NetworkTable.h>
+#include <networktables/DoubleTopic.h>
+#include <networktables/DoubleArrayTopic.h>
 #include "PeripherySession.h"
+#include "PeripheryReactor.h"
+#include "InferenceScheduler.h"
+#include "UploadRateController.h"
+#include "DetectionTracker.h"
+#include "ThreadPlacement.h"
+#include "FrameRing.h"
+#include "FrameSource.h"
+#include "DetectorTuner.h"
+#include "MultiTagSolver.h"
+#include "FrameRecorder.h"
+#include "PipelineStats.h"
+#include "SnapshotBuffer.h"
+#include "NetworkClock.h"
 
 using namespace frc;
 
 class Camera {
   public:
-    Camera(cs::UsbCamera *cam, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig);
+    // How frames are pulled from the camera for tag detection
+    enum class CaptureMode {
+      kBGR,           // full decode to BGR, gray converted from it
+      kGray,          // decode only the MJPEG luma plane
+      kGrayHalf,      // decode only the MJPEG luma plane at 1/2 scale
+      kGrayQuarter    // decode only the MJPEG luma plane at 1/4 scale
+    };
+
+    // Live USB camera known by id, also streams the labelled frames to the dashboard
+    Camera(cs::UsbCamera *cam, uint8_t id, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, CaptureMode mode = CaptureMode::kBGR);
+
+    // Any frame source, without a dashboard stream
+    Camera(std::unique_ptr<FrameSource> frameSource, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, CaptureMode mode = CaptureMode::kBGR);
+
+    ~Camera();
 
     // AprilTag Detection struct
     struct TagDetection {
@@ -22,6 +58,70 @@ class Camera {
       Transform3d transform;
     };
 
+    // Pipeline stages that publish frames into the ring
+    enum Stage {
+      kCaptured = 0,
+      kConverted,
+      kProcessed,
+      kLabelled,
+      kStageCount
+    };
+
+    // Frame data carried through the pipeline ring
+    struct Frame {
+      uint64_t captureTime = 0;  // grab time (us) in NT server time, or local time when serverTime is false
+      bool serverTime = false;   // the NT clock had synced when the frame was stamped
+      std::vector<uchar> jpeg;  // compressed grab, empty when cscore decoded the frame
+      cv::Mat frame;          // BGR, decoded lazily when the grab kept its JPEG
+      cv::Mat gray;
+      cv::Mat motion;         // gray thumbnail the ML motion gate compares, empty when the gate is off
+      cv::Mat labelled;
+      std::vector<TagDetection> tags;
+      MultiTagSolver::FieldPose fieldPose;
+      std::mutex colorLock;
+      bool colorReady = false;
+
+      // When the grab started and when the frame left each stage
+      std::chrono::steady_clock::time_point grabStarted;
+      std::chrono::steady_clock::time_point stageDone[kStageCount];
+    };
+
+    // Tag detections of one processed frame, as handed to the NT publisher
+    struct TagSnapshot {
+      uint64_t seq = 0;           // ring sequence of the frame, 0 before the first
+      uint64_t captureTime = 0;
+      bool serverTime = false;    // captureTime is NT server time rather than local
+      std::vector<TagDetection> tags;
+    };
+
+    // Tracked ML detections as of one frame, inferred on it or predicted from earlier replies
+    struct MLSnapshot {
+      uint32_t seq = 0;           // request sequence of the last reply folded in, 0 before the first
+      uint64_t captureTime = 0;   // frame the detections stand for
+      bool serverTime = false;    // captureTime is NT server time rather than local
+      PeripherySession::Detections detections;
+      std::vector<uint16_t> trackIds;   // persistent ID of each detection
+      std::vector<uint8_t> predicted;   // each detection moved by the tracker rather than inferred on this frame
+    };
+
+    // Frames skipped by each pipeline thread because a newer one was ready
+    struct DroppedFrames {
+      uint64_t converter = 0;
+      uint64_t processor = 0;
+      uint64_t labeller = 0;
+      uint64_t poster = 0;
+      uint64_t inference = 0;
+    };
+
+    // Occupancy of the per-camera frame pool
+    struct PoolStats {
+      int slots = 0;
+      int inUse = 0;
+      int highWater = 0;
+      uint64_t exhausted = 0;
+      uint64_t reallocations = 0;
+    };
+
     // Fetch Camera id
     uint8_t GetID();
     
@@ -31,39 +131,96 @@ class Camera {
     // Set current AprilTags being estimated
     void SetTargetTags(std::vector<uint8_t> targets);
 
-    // Get current TagDetection vector from Camera
-    std::vector<Camera::TagDetection>* GetTagDetections();
+    // Search only around last frame's tags between periodic full-frame scans
+    void SetTagTracking(bool enabled);
+
+    // Solve a field-relative pose from all visible tags each frame, call before StartStream
+    void EnableFieldPose(AprilTagFieldLayout layout, Transform3d robotToCamera = {});
+
+    // Publish per-stage latency and throughput under the given table, plus the ML request
+    // counters as mlRequests [timeouts, late replies, out-of-order, malformed, send failures]
+    // and the frame pool as pool [slots, in use, high water, exhausted, reallocations];
+    // call before StartStream
+    void SetStatsTable(std::shared_ptr<nt::NetworkTable> table);
 
-    // Get total current tag detections
-    int GetTagDetectionCount();
+    // Publish a stats snapshot covering the time since the last one, call about once a second
+    void PublishStats();
 
-    // Get current ML Detection vector from Camera
-    std::vector<PeripherySession::Detection>* GetMLDetections();
+    // Note that the latest detections were posted to NT, times detection to publish
+    void MarkPublished();
 
-    // Get total current ML detections
-    int GetMLDetectionCount();
+    // Size the ML server expects, frames of another size are resized and re-encoded; 0x0 sends native frames
+    void SetMLInputSize(cv::Size size);
 
-    // Get system time (millis) of last frame grab
-    uint32_t GetCaptureTime();
+    // Bytes per second ML uploads may take over UDP, JPEG quality then resolution drop to hold it; 0 sends
+    // the camera's JPEG as-is. Call before StartInferencing
+    void SetUploadBudget(double bytesPerSecond);
 
-    // Stop overwriting the tag detection buffer
+    // Set how many ML requests may be in flight at once, call before StartInferencing
+    void SetInferenceWindow(int requests);
+
+    // Skip inference on frames whose thumbnail differs from the last one sent by less than
+    // threshold (mean gray levels), holding the last detections for at most maxHold; 0 disables.
+    // Call before StartStream
+    void SetMotionGate(double threshold, std::chrono::milliseconds maxHold);
+
+    // Record every grabbed frame's MJPEG bytes under directory, call before StartStream
+    void EnableRecording(std::string directory);
+
+    // Set the AprilTag detection time the detector settings are tuned to hold (ms)
+    void SetDetectLatencyTarget(double ms);
+
+    // Publish camera telemetry under the given table, call before StartStream
+    void SetTelemetryTable(std::shared_ptr<nt::NetworkTable> table);
+
+    // Newest tag detections, NT publisher thread only; valid until its next call
+    const TagSnapshot& GetTagSnapshot();
+
+    // Newest ML detections, NT publisher thread only; valid until its next call
+    const MLSnapshot& GetMLSnapshot();
+
+    // Call back whenever new tag or ML detections are ready, call before StartStream
+    void SetDetectionsCallback(std::function<void()> callback);
+
+    // Get the grab time (us, NT server time) of the last frame
+    uint64_t GetCaptureTime();
+
+    // Stop publishing new tag detections
     void PauseTagDetection();
 
-    // Resume overwriting the tag detection buffer
+    // Resume publishing new tag detections
     void ResumeTagDetection();
 
-    // Draw AprilTag outline on frame
-    void DrawAprilTagBox(cv::Mat frame, TagDetection* tag);
+    // Draw AprilTag outline on a frame scale times the capture size
+    void DrawAprilTagBox(cv::Mat frame, TagDetection* tag, double scale = 1);
+
+    // Draw ML detection on a frame scale times the capture size
+    void DrawInferenceBox(cv::Mat frame, const PeripherySession::Detections &detections, double scale = 1);
 
-    // Draw ML detection on frame
-    void DrawInferenceBox(cv::Mat frame, std::vector<PeripherySession::Detection> &detections);
+    // Cap the dashboard stream at fps (0 for every frame) and 1/scale of the capture size, any thread
+    void SetStreamLimits(double fps, int scale);
 
     // Check if there is currently a valid frame from the Camera
     bool ValidPresent();
 
+    // Get frames skipped by each pipeline thread
+    DroppedFrames GetDroppedFrames();
+
+    // Get frame pool occupancy and high-water mark
+    PoolStats GetPoolStats();
+
+    // Newest frame sequence number a stage has finished
+    uint64_t GetStageSeq(Stage stage);
+
+    // Call back with every frame the labeller finishes, call before StartStream
+    void SetFrameCallback(std::function<void(Frame&)> callback);
+
     // Start all threads except machine learning
     void StartStream();
 
+    // Stop and join all threads except machine learning
+    void StopStream();
+
     // Start frame collector
     void StartCollector();
 
@@ -73,16 +230,35 @@ class Camera {
     // Start processing frames
     void StartProcessor();
 
-    // Start ML thread
+    // Stop sending frames to the ML server and close the session
     void StopInferencing();
 
-    // Start ML thread
-    void StartInferencing(PeripherySession session);
+    // Send frames to the ML server through a session driven by the reactor, in the slots the
+    // scheduler hands this camera; call on the reactor thread
+    void StartInferencing(PeripherySession session, PeripheryReactor *reactor, InferenceScheduler *scheduler);
+
+    // Send a frame to the ML server, returns its request sequence number
+    uint32_t SendInference(PeripherySession &session, Frame &data);
+
+    // Have the reactor offer the newest frame to the scheduler
+    void NotifyInference();
+
+    // Expire lost requests and refill the freed slots, reactor thread only
+    void PumpInference();
+
+    // Send the newest frame the motion gate lets through, false if there's none or it failed to send; reactor thread only
+    bool SendNextInference();
 
-    // Actual ML lambda
-    void InferenceThread();
+    // Prepare resized or rate-controlled ML uploads off the reactor, as the reactor asks for them
+    void StartMLEncoder();
 
-    // Start labelling frames
+    // Apply every reply waiting on the session socket, reactor thread only
+    void CollectInference();
+
+    // Add what the session counted since the last call to the camera's totals, reactor thread only
+    void TallySession();
+
+    // Start labelling frames, only while the dashboard stream has a viewer
     void StartLabeller();
 
     // Start posting labelled frames
@@ -96,47 +272,227 @@ class Camera {
     
   
   private:
-    const int threadDelay = 1;
-    std::vector<uint8_t> targetTags{22, 18};
+    // Frame slots per camera, one per pipeline thread plus headroom for the writer
+    static constexpr int FramePoolSize = 8;
+    using Ring = FrameRing<Frame, kStageCount, FramePoolSize>;
+
+    // Width of the motion gate thumbnail, height keeps the aspect
+    static constexpr int MotionThumbnailWidth = 32;
+
+    // Detection arrays are sized for this many per frame, with up to 17 (x, y, confidence) keypoints each
+    static constexpr int MaxMLDetections = 100;
+    static constexpr int MaxMLKeypoints = 17 * 3;
+
+    // Last known image bounds and motion of a tag, in gray image pixels
+    struct TrackedTag {
+      uint8_t id = 0;
+      double minX = 0;
+      double minY = 0;
+      double maxX = 0;
+      double maxY = 0;
+      double velocityX = 0;
+      double velocityY = 0;
+    };
+
+    // Detect requested tags inside a region of the gray image
+    void DetectTags(cv::Mat &gray, cv::Rect region, std::vector<TagDetection> &tags);
+
+    // Build padded search regions around the predicted tag positions
+    void BuildTrackingRegions(cv::Size size);
+
+    // Publish detector settings and timing for the last frame
+    void PublishDetectorStatus(bool settingsChanged);
+
+    // Publish the field pose solved for a frame
+    void PublishFieldPose(Frame &data);
+
+    // Name the calling pipeline thread after this camera and stage and place it by role
+    void PlaceThread(const char *stage, ThreadPlacement::Role role);
+
+    // Stamp a frame leaving a stage and hand it on
+    void PublishStage(Stage stage, Ring::Slot* slot);
+
+    // Count a pooled buffer whose storage moved
+    void TrackReallocation(const cv::Mat &mat, const uchar *previous);
+
+    // Get the BGR image of a frame, decoding it on first use
+    cv::Mat& GetColorFrame(Frame &data);
+
+    // Whether a frame's BGR image is decoded yet
+    bool HasColorFrame(Frame &data);
+
+    // Gray image downscale factor of a capture mode
+    static int GetGrayScale(CaptureMode mode);
+
+    // A frame resized or re-encoded for the ML server, encoder thread to reactor
+    struct MLUpload {
+      std::vector<uchar> jpeg;      // empty when the server reads the pixels from shared memory
+      cv::Mat pixels;
+      uint64_t captureTime = 0;
+      bool serverTime = false;
+      cv::Size2d scale{1, 1};
+      cv::Mat motion;               // the frame's motion thumbnail, becomes the gate's reference once sent
+      std::chrono::steady_clock::time_point queued;   // when the frame was ready for inference
+    };
+
+    // Resize or re-encode a frame at the upload controller's setting, encoder thread only
+    void PrepareUpload(Frame &data, MLUpload &upload);
+
+    // Send the encoder's newest upload, false if it has none ready; reactor thread only
+    bool SendPreparedInference();
+
+    // Have the encoder prepare an upload from the newest frame, reactor thread only
+    void RequestUpload();
+
+    // Whether the next upload needs resizing or re-encoding, or the camera's own bytes will do
+    bool EncodeNextUpload();
+
+    // Wake the reactor when the oldest request in flight would time out
+    void ArmInferenceExpiry();
+
+    // Whether a frame looks enough like the last one sent that the last detections still stand
+    bool HoldInference(Frame &data);
+
+    // Publish the tracked detections as of a frame's capture time, reactor thread only
+    void PublishTracks(uint64_t time);
+
+    // Pose estimator intrinsics for a gray image downscaled by scale
+    static AprilTagPoseEstimator::Config ScaleEstimatorConfig(AprilTagPoseEstimator::Config config, int scale);
+
+    // How long a pipeline thread waits for a frame before checking in again
+    const std::chrono::milliseconds frameTimeout{100};
+
+    // Requested tag IDs as a bitset, set from NT while the processor reads it
+    std::atomic<uint64_t> targetTags[4] = {(1ull << 18) | (1ull << 22), 0, 0, 0};
 
     uint8_t id = -1;
-    cs::UsbCamera *cam = nullptr;
-    cs::CvSink *sink = nullptr;
+    std::unique_ptr<FrameSource> frameSource;
+    CaptureMode captureMode = CaptureMode::kBGR;
+    int grayScale = 1;
+    cv::Size captureSize;
+    cv::Size mlInputSize{0, 0};
+    UploadRateController uploadRate;    // reactor thread only, but for its getters
+
+    // ML encoder thread, prepares uploads when a session needs resizing or rate control
+    cv::Mat mlResized;
+    std::vector<int> mlEncodeParams{cv::IMWRITE_JPEG_QUALITY, 95};
+    SnapshotBuffer<MLUpload> mlUploads;
+    bool mlResizeUploads = false;               // set per session, the server wants another size
+    bool mlRateControlled = false;              // set per session, UDP uploads under the controller's budget
+    std::atomic<bool> mlUploadShared = false;   // the session reads pixels from shared memory
+    std::atomic<bool> mlUploadWanted = false;
+    bool mlUploadRequested = false;             // reactor thread only, asked and not yet taken
+    std::mutex mlEncodeMutex;
+    std::condition_variable mlEncodeWake;
+    Ring::Cursor mlEncodeCursor;
+    int mlWindow = 2;
+
+    // ML requests are driven by the shared reactor, these are only touched on its thread
+    PeripheryReactor *reactor = nullptr;
+    InferenceScheduler *scheduler = nullptr;
+    PeripherySession::Result inferenceResult;
+    uint32_t appliedInferenceSeq = 0;
+    uint64_t sessionMalformedReplies = 0;   // current session's counts when last read
+    uint64_t sessionSendFailures = 0;
+    uint64_t sessionLateReplies = 0;
+    bool inferenceExpiryQueued = false;
+    std::atomic<bool> inferencePumpQueued = false;
+    DetectionTracker tracker;
+    PeripherySession::Detections mlTracked;
+    std::vector<uint16_t> mlTrackIds;
+    std::vector<uint8_t> mlPredicted;
+    uint64_t mlPublishedTime = 0;
+    bool mlPublishedEmpty = true;
+    uint32_t mlServerTimeSeq = 0;   // first request stamped in NT server time, 0 until one goes out
+    bool mlServerTime = false;      // time base of the tracks, they restart when it changes
+
+    // Motion gate, the reference is the thumbnail of the last frame sent; the encoder gates too
+    double motionThreshold = 0;
+    uint64_t motionMaxHoldUs = 0;
+    Stage mlInputStage = kCaptured;     // kConverted when gated, the thumbnail is made there
+    std::mutex motionLock;
+    cv::Mat motionReference;
+    uint64_t motionReferenceTime = 0;
+    std::atomic<uint64_t> mlHeldFrames = 0;
     cs::CvSource *source = nullptr;
     AprilTagDetector detector{};
     AprilTagPoseEstimator estimator;
-    cv::Mat frame{};
-    cv::Mat mlFrame{};
-    cv::Mat gray{};
-    cv::Mat labelled{};
+    AprilTagPoseEstimator::Config intrinsics;
+    std::unique_ptr<MultiTagSolver> fieldSolver;
+    std::unique_ptr<FrameRecorder> recorder;
+    Ring ring;
+    Ring::Cursor converterCursor;
+    Ring::Cursor processorCursor;
+    Ring::Cursor labellerCursor;
+    Ring::Cursor posterCursor;
+    Ring::Cursor mlCursor;
+    std::atomic<uint64_t> reallocations = 0;
+    std::function<void(Frame&)> frameCallback;
+    std::atomic<bool> running = false;
     bool mlEnabled = true;
-    bool mlSessionAvailable = false;
+    std::atomic<bool> mlSessionAvailable = false;
     int sock = -1;
   
-    uint32_t captureTime = 0;
+    std::atomic<uint64_t> captureTime = 0;
+    std::atomic<bool> captureServerTime = false;
     unsigned long lastFail = 0;
-    bool newFrame = false;
-    bool newInference = false;
-    bool frameProcessed = false;
-    bool validFrame = false;
-    bool grayAvailable = false;
-    bool frameLabelled = false;
-    bool framePosted = false;
-    bool mlFrameAvailable = false;
-    bool newDetections = false;
-    bool pauseTagDetections = false;
-
-    std::vector<TagDetection> tagDetections;
-    int tagDetectionCount = 0;
-    int mlDetectionCount = 0;
+    std::atomic<bool> validFrame = false;
+    std::atomic<bool> pauseTagDetections = false;
+
+    // Dashboard stream, labeller thread reads them
+    std::atomic<double> streamFps = 0;
+    std::atomic<int> streamScale = 1;
+    std::chrono::steady_clock::time_point lastLabelled{};
+
+    // Region-of-interest tag tracking, only touched by the processor thread
+    std::atomic<bool> tagTracking = true;
+    const int fullScanInterval = 10;
+    const double trackingPadding = 0.5;
+    int framesSinceFullScan = 0;
+    std::vector<TrackedTag> trackedTags;
+    std::vector<TrackedTag> foundTags;
+    std::vector<cv::Rect> trackingRegions;
+
+    // Detector latency control, only touched by the processor thread
+    DetectorTuner tuner;
+    double frameDetectMs = 0;
+    double frameEstimateMs = 0;
+
+    // Pipeline latency stats
+    PipelineStats stats;
+    std::shared_ptr<nt::NetworkTable> statsTable;
+    nt::DoubleArrayPublisher uploadPub;
+    nt::DoubleArrayPublisher mlRequestsPub;
+    nt::DoubleArrayPublisher poolPub;
+    std::atomic<uint64_t> failedGrabs = 0;
+    std::atomic<uint64_t> mlTimeouts = 0;
+    std::atomic<uint64_t> mlStaleResults = 0;
+    std::atomic<uint64_t> mlMalformedReplies = 0;
+    std::atomic<uint64_t> mlSendFailures = 0;
+    std::atomic<uint64_t> mlLateReplies = 0;     // answers to requests already timed out, the window's RTO is too short
+    std::atomic<int64_t> processedAt = 0;   // steady clock ticks when the latest detections were ready
+    uint64_t lastPublishedSeq = 0;
+
+    std::shared_ptr<nt::NetworkTable> telemetry;
+    nt::DoublePublisher detectMsPub;
+    nt::DoublePublisher detectAverageMsPub;
+    nt::DoublePublisher quadDecimatePub;
+    nt::DoublePublisher quadSigmaPub;
+    nt::DoublePublisher numThreadsPub;
+    nt::DoubleArrayPublisher fieldPosePub;
+
+    // Detections handed to the NT publisher and the labeller
+    SnapshotBuffer<TagSnapshot> tagSnapshots;
+    SnapshotBuffer<MLSnapshot> mlSnapshots;
+    SnapshotBuffer<MLSnapshot> labelSnapshots;
+    std::function<void()> detectionsCallback;
+
     std::vector<PeripherySession> mlSessions;
-    std::vector<PeripherySession::Detection> mlDetections;
-    std::vector<PeripherySession::Detection> volatileDetections;
 
     std::thread collector;
     std::thread converter;
     std::thread processor;
-    std::thread mlThread;
     std::thread labeller;
+    std::thread mlEncoder;
     std::thread poster;
 };
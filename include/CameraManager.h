@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cameraserver/CameraServer.h>
+
+#include "Camera.h"
+
+// Every USB camera the pipeline runs. Cameras plugged in at startup are opened
+// concurrently, ones plugged in later are attached by a background monitor.
+// Cameras are only ever added, never removed, so other threads can iterate
+// them while the monitor adds one. A camera that drops off the bus keeps its
+// Camera and picks up again when its USB port or serial shows up again.
+// Camera IDs are handed out here, in USB port order at startup and then in
+// attach order, and never reused; the /dev/video node a camera happens to sit
+// on can change under it and be taken by another camera.
+class CameraManager {
+  public:
+    // Most cameras that can be attached
+    static constexpr int MaxCameras = 8;
+
+    CameraManager(cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, Camera::CaptureMode mode);
+
+    ~CameraManager();
+
+    // Configure and start a newly opened camera before it's visible, call before OpenAll
+    void SetSetup(std::function<void(Camera&)> setup);
+
+    // Open every camera plugged in now, all at once; returns how many are running
+    int OpenAll();
+
+    // Look for new and returning cameras every interval on a background thread
+    void StartMonitor(std::chrono::milliseconds interval);
+
+    // Stop and join the monitor thread
+    void StopMonitor();
+
+    // Cameras running, only ever grows
+    int Size();
+
+    Camera& operator[](int index);
+
+    // Walks the cameras that were running when begin() was called
+    class Iterator {
+      public:
+        Iterator(CameraManager *manager, int index) : manager(manager), index(index) {}
+        Camera& operator*() { return (*manager)[index]; }
+        Iterator& operator++() { index++; return *this; }
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+
+      private:
+        CameraManager *manager;
+        int index;
+    };
+
+    Iterator begin();
+
+    Iterator end();
+
+  private:
+    // A camera and the device it was opened from
+    struct Entry {
+      std::string key;      // by-path or by-id link, the same across re-enumeration
+      std::unique_ptr<cs::UsbCamera> usb;
+      std::unique_ptr<Camera> camera;
+      bool connected = true;
+      std::chrono::steady_clock::time_point lostAt;
+    };
+
+    // Name of a device that survives it dropping off the bus: its USB port, else serial, else node
+    static std::string GetKey(const cs::UsbCameraInfo &info);
+
+    // Open, configure and start one camera under id, logging how long it took
+    std::unique_ptr<Entry> Open(const cs::UsbCameraInfo &info, uint8_t id);
+
+    // Make an opened camera visible to readers, false if there's no room left
+    bool Add(std::unique_ptr<Entry> entry);
+
+    // Log how long a camera took from opening to its first frame
+    void LogFirstFrame(Entry &entry, std::chrono::steady_clock::time_point opened);
+
+    // Attach new cameras and follow dropped ones until stopped
+    void Monitor(std::chrono::milliseconds interval);
+
+    // Whether a device is already attached
+    bool Known(const std::string &key);
+
+    cs::VideoMode config;
+    AprilTagPoseEstimator::Config estConfig;
+    Camera::CaptureMode mode;
+    std::function<void(Camera&)> setup;
+
+    std::array<std::unique_ptr<Entry>, MaxCameras> entries;
+    std::atomic<int> count = 0;
+    std::atomic<int> nextId = 0;   // ID of the next camera opened
+    std::mutex addLock;     // held while appending
+
+    std::thread monitor;
+    std::mutex monitorLock;
+    std::condition_variable monitorWake;
+    bool monitorRunning = false;
+};
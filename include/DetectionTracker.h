@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PeripherySession.h"
+
+// Carries ML detections between inference replies. Each box becomes a track
+// with a persistent ID and a constant-velocity estimate of its center; fresh
+// replies are matched to tracks by IoU and correct them with an alpha-beta
+// filter, and in between the tracks are moved to every captured frame's time.
+// Not thread safe, the camera drives it from the reactor thread.
+class DetectionTracker {
+  public:
+    // Fold in the detections of a fresh reply, in capture pixels
+    void Update(const PeripherySession::Detections &detections);
+
+    // Boxes of the live tracks moved to time (us), with each one's track ID and whether
+    // it was predicted rather than inferred on that frame
+    void Predict(uint64_t time, PeripherySession::Detections &out, std::vector<uint16_t> &ids, std::vector<uint8_t> &predicted);
+
+    // Capture time of the reply last folded in
+    uint64_t GetUpdateTime();
+
+    // Drop every track, IDs carry on from where they were
+    void Reset();
+
+  private:
+    struct Track {
+      uint16_t id = 0;
+      uint8_t label = 0;
+      double centerX = 0;
+      double centerY = 0;
+      double width = 0;
+      double height = 0;
+      double velocityX = 0;   // pixels per second
+      double velocityY = 0;
+      uint64_t time = 0;      // capture time of the last reply that matched
+      int hits = 0;           // replies matched, a track is confirmed after confirmHits
+      int misses = 0;         // replies in a row without a match
+      std::vector<double> kps;        // keypoints as last inferred
+      double kpsCenterX = 0;          // box center they were inferred at
+      double kpsCenterY = 0;
+    };
+
+    // A track and detection that could be the same object
+    struct Candidate {
+      double iou = 0;
+      int track = 0;
+      int detection = 0;
+    };
+
+    // Overlap of two boxes given by top-left corner and size
+    static double IoU(double ax, double ay, double aw, double ah, double bx, double by, double bw, double bh);
+
+    // Seconds from one capture time to another
+    static double Seconds(uint64_t from, uint64_t to);
+
+    // Least IoU between a track's predicted box and a detection to match them
+    const double matchIoU = 0.3;
+
+    // Filter gains, how far a reply pulls position and velocity toward what it saw
+    const double alpha = 0.6;
+    const double beta = 0.3;
+
+    // Replies a track needs before it's predicted between them
+    const int confirmHits = 2;
+
+    // Replies a confirmed track survives without a match
+    const int maxMisses = 3;
+
+    // Longest a track is predicted past its last match (us)
+    const uint64_t maxCoastUs = 1000000;
+
+    std::vector<Track> tracks;
+    std::vector<Candidate> candidates;
+    std::vector<int> trackMatch;
+    std::vector<bool> detectionMatched;
+    std::vector<std::vector<double>> spareKps;    // keypoint storage of dropped tracks, for the next new ones
+    uint16_t nextId = 1;
+    uint64_t updateTime = 0;
+};
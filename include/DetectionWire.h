@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Wire format of the tagBuf and mlBuf NT entries, shared by the encoder here
+// and decoders on the robot. Everything is packed and little-endian:
+//
+//   header      version u8, kind u8, flags u8 (see HeaderFlags), record count u16
+//   tag record  tag id u8, camera id u8, capture time u64 (us, see kServerTime),
+//               translation x, y, z int16 (mm, saturated at +-32.767 m),
+//               rotation u32 (quaternion, see PackQuaternion)
+//   ML record   label u8, camera id u8, flags u8 (see MLFlags), track id u16,
+//               capture time u64 (us, see kServerTime),
+//               box x, y, width, height int16 (pixels of the captured frame)
+//
+// A tag record is 20 bytes, against 58 for the struct copies this format
+// replaced, and an ML record 21, exactly half the old 42. A decoder should
+// reject a version it doesn't know and a size that isn't exactly the header
+// plus count records.
+namespace DetectionWire {
+  constexpr uint8_t Version = 1;
+
+  // What the records of a buffer are
+  enum Kind : uint8_t {
+    kTags = 1,
+    kML = 2
+  };
+
+  // Bits of a header's flags
+  enum HeaderFlags : uint8_t {
+    kServerTime = 1   // capture times are NT server time, clear while the coprocessor's clock hasn't synced and they're its own
+  };
+
+  // Bits of an ML record's flags
+  enum MLFlags : uint8_t {
+    kPredicted = 1    // box moved by the tracker from earlier replies, not inferred on this frame
+  };
+
+  constexpr size_t HeaderSize = 5;
+  constexpr size_t TagRecordSize = 20;
+  constexpr size_t MLRecordSize = 21;
+
+  struct Header {
+    uint8_t version = Version;
+    uint8_t kind = 0;
+    uint8_t flags = 0;
+    uint16_t count = 0;
+  };
+
+  // Tag pose relative to the camera, translation in meters
+  struct TagRecord {
+    uint8_t tagId = 0;
+    uint8_t camId = 0;
+    uint64_t captureTime = 0;
+    double x = 0;
+    double y = 0;
+    double z = 0;
+    double qw = 1;
+    double qx = 0;
+    double qy = 0;
+    double qz = 0;
+  };
+
+  // ML box in captured frame pixels
+  struct MLRecord {
+    uint8_t label = 0;
+    uint8_t camId = 0;
+    uint8_t flags = 0;
+    uint16_t trackId = 0;   // the same object keeps its ID from frame to frame
+    uint64_t captureTime = 0;
+    int16_t x = 0;
+    int16_t y = 0;
+    int16_t width = 0;
+    int16_t height = 0;
+  };
+
+  inline void PutU16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+  }
+
+  inline void PutU32(uint8_t *out, uint32_t value) {
+    for(int i = 0; i < 4; i++) out[i] = (value >> (8 * i)) & 0xff;
+  }
+
+  inline void PutU64(uint8_t *out, uint64_t value) {
+    for(int i = 0; i < 8; i++) out[i] = (value >> (8 * i)) & 0xff;
+  }
+
+  inline uint16_t GetU16(const uint8_t *in) {
+    return in[0] | (in[1] << 8);
+  }
+
+  inline uint32_t GetU32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+  }
+
+  inline uint64_t GetU64(const uint8_t *in) {
+    return GetU32(in) | ((uint64_t)GetU32(in + 4) << 32);
+  }
+
+  // Round and clamp to int16
+  inline int16_t Saturate(double value) {
+    return (int16_t)std::clamp(std::lround(value), -32767l, 32767l);
+  }
+
+  // Quaternion as "smallest three": bits 30-31 index the largest component (w, x, y, z),
+  // which is dropped and made positive; the other three follow in order as 10-bit
+  // values over [-1/sqrt(2), 1/sqrt(2)], most significant first. Decodes to within a quarter degree.
+  inline uint32_t PackQuaternion(double w, double x, double y, double z) {
+    double q[4] = {w, x, y, z};
+    double norm = std::sqrt(w * w + x * x + y * y + z * z);
+    if(norm == 0) return 0;
+    int largest = 0;
+    for(int i = 1; i < 4; i++) {
+      if(std::fabs(q[i]) > std::fabs(q[largest])) largest = i;
+    }
+    double sign = q[largest] < 0 ? -1 : 1;
+    uint32_t packed = (uint32_t)largest << 30;
+    int shift = 20;
+    for(int i = 0; i < 4; i++) {
+      if(i == largest) continue;
+      double value = sign * q[i] / norm * M_SQRT2;   // now in [-1, 1]
+      uint32_t level = (uint32_t)std::clamp(std::lround((value + 1) * 511.5), 0l, 1023l);
+      packed |= level << shift;
+      shift -= 10;
+    }
+    return packed;
+  }
+
+  inline void UnpackQuaternion(uint32_t packed, double &w, double &x, double &y, double &z) {
+    double q[4];
+    int largest = packed >> 30;
+    int shift = 20;
+    double sum = 0;
+    for(int i = 0; i < 4; i++) {
+      if(i == largest) continue;
+      q[i] = (((packed >> shift) & 1023) / 511.5 - 1) / M_SQRT2;
+      sum += q[i] * q[i];
+      shift -= 10;
+    }
+    q[largest] = std::sqrt(std::max(0.0, 1 - sum));
+    w = q[0];
+    x = q[1];
+    y = q[2];
+    z = q[3];
+  }
+
+  inline void WriteHeader(uint8_t *out, Kind kind, uint8_t flags, uint16_t count) {
+    out[0] = Version;
+    out[1] = kind;
+    out[2] = flags;
+    PutU16(out + 3, count);
+  }
+
+  inline void EncodeTag(uint8_t *out, const TagRecord &tag) {
+    out[0] = tag.tagId;
+    out[1] = tag.camId;
+    PutU64(out + 2, tag.captureTime);
+    PutU16(out + 10, Saturate(tag.x * 1000));
+    PutU16(out + 12, Saturate(tag.y * 1000));
+    PutU16(out + 14, Saturate(tag.z * 1000));
+    PutU32(out + 16, PackQuaternion(tag.qw, tag.qx, tag.qy, tag.qz));
+  }
+
+  inline void EncodeML(uint8_t *out, const MLRecord &detection) {
+    out[0] = detection.label;
+    out[1] = detection.camId;
+    out[2] = detection.flags;
+    PutU16(out + 3, detection.trackId);
+    PutU64(out + 5, detection.captureTime);
+    PutU16(out + 13, detection.x);
+    PutU16(out + 15, detection.y);
+    PutU16(out + 17, detection.width);
+    PutU16(out + 19, detection.height);
+  }
+
+  inline TagRecord DecodeTag(const uint8_t *in) {
+    TagRecord tag;
+    tag.tagId = in[0];
+    tag.camId = in[1];
+    tag.captureTime = GetU64(in + 2);
+    tag.x = (int16_t)GetU16(in + 10) / 1000.0;
+    tag.y = (int16_t)GetU16(in + 12) / 1000.0;
+    tag.z = (int16_t)GetU16(in + 14) / 1000.0;
+    UnpackQuaternion(GetU32(in + 16), tag.qw, tag.qx, tag.qy, tag.qz);
+    return tag;
+  }
+
+  inline MLRecord DecodeML(const uint8_t *in) {
+    MLRecord detection;
+    detection.label = in[0];
+    detection.camId = in[1];
+    detection.flags = in[2];
+    detection.trackId = GetU16(in + 3);
+    detection.captureTime = GetU64(in + 5);
+    detection.x = (int16_t)GetU16(in + 13);
+    detection.y = (int16_t)GetU16(in + 15);
+    detection.width = (int16_t)GetU16(in + 17);
+    detection.height = (int16_t)GetU16(in + 19);
+    return detection;
+  }
+
+  // Check a buffer's header against its size, false if it can't be decoded
+  inline bool ReadHeader(const uint8_t *in, size_t size, Header &header) {
+    if(size < HeaderSize || in[0] != Version) return false;
+    header.version = in[0];
+    header.kind = in[1];
+    header.flags = in[2];
+    header.count = GetU16(in + 3);
+    size_t recordSize = header.kind == kTags ? TagRecordSize : header.kind == kML ? MLRecordSize : 0;
+    return recordSize && size == HeaderSize + header.count * recordSize;
+  }
+
+  // Reference decoder for a tagBuf, false if the buffer is malformed
+  inline bool DecodeTags(const uint8_t *in, size_t size, std::vector<TagRecord> &tags) {
+    Header header;
+    if(!ReadHeader(in, size, header) || header.kind != kTags) return false;
+    tags.clear();
+    for(int i = 0; i < header.count; i++) {
+      tags.push_back(DecodeTag(in + HeaderSize + i * TagRecordSize));
+    }
+    return true;
+  }
+
+  // Reference decoder for an mlBuf, false if the buffer is malformed
+  inline bool DecodeDetections(const uint8_t *in, size_t size, std::vector<MLRecord> &detections) {
+    Header header;
+    if(!ReadHeader(in, size, header) || header.kind != kML) return false;
+    detections.clear();
+    for(int i = 0; i < header.count; i++) {
+      detections.push_back(DecodeML(in + HeaderSize + i * MLRecordSize));
+    }
+    return true;
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <apriltag/frc/apriltag/AprilTagDetector.h>
+
+using namespace frc;
+
+// Steps AprilTag detector settings between accuracy and speed to hold a latency target
+class DetectorTuner {
+  public:
+    DetectorTuner(double targetMs = 15.0);
+
+    // One rung of the settings ladder, ordered from most accurate to fastest
+    struct Level {
+      int numThreads;
+      float quadDecimate;
+      float quadSigma;
+    };
+
+    // Feed the detection time of one frame, returns true if the settings changed.
+    // Everything but the target is owned by the thread running the detector.
+    bool Update(double detectMs);
+
+    // Detector config for the current level
+    AprilTagDetector::Config GetConfig();
+
+    // Current ladder level
+    Level GetLevel();
+
+    // Smoothed detection time (ms)
+    double GetAverageMs();
+
+    // Change the latency target (ms)
+    void SetTargetMs(double ms);
+
+    // Get the latency target (ms)
+    double GetTargetMs();
+
+  private:
+    static constexpr Level Levels[] = {
+      {1, 1.0f, 0.0f},
+      {2, 1.0f, 0.0f},
+      {2, 1.5f, 0.0f},
+      {3, 2.0f, 0.0f},
+      {3, 3.0f, 0.4f},
+      {4, 4.0f, 0.8f},
+    };
+    static constexpr int LevelCount = sizeof(Levels) / sizeof(Levels[0]);
+
+    // Weight of the newest sample in the smoothed time
+    const double smoothing = 0.2;
+    // Fraction of the target we must stay under before trying a more accurate level
+    const double headroom = 0.6;
+    // Frames to wait after a change before judging the new level
+    const int settleFrames = 5;
+    // Frames of headroom needed before stepping back, doubles when a step back fails
+    const int minRelaxFrames = 30;
+    const int maxRelaxFrames = 960;
+
+    std::atomic<double> targetMs;
+    double averageMs = 0;
+    int level = 0;
+    int maxThreads = 1;
+    int framesSinceChange = 0;
+    int framesWithHeadroom = 0;
+    int relaxFrames = minRelaxFrames;
+    bool relaxed = false;
+};
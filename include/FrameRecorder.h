@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+// On-disk recording layout, shared with ReplayFrameSource. Each segment is a
+// pair of preallocated files: <name>.mjpeg holds the camera's JPEG bytes back
+// to back (so it also plays as a plain MJPEG stream) and <name>.mjpeg.idx holds
+// an IndexHeader followed by one IndexEntry per grab. Segments are named
+// cam<id>-<number>.mjpeg; grab times restart with every process, so each
+// header carries the wall-clock start of the run that wrote it. Everything
+// is little-endian.
+namespace Recording {
+  constexpr char IndexMagic[8] = {'L', 'V', 'R', 'E', 'C', 'I', 'D', 'X'};
+  constexpr uint32_t Version = 2;
+  // Version 1 headers stop before runStart
+  constexpr size_t V1HeaderSize = 16;
+
+  // Entry has timing only, the frame bytes were dropped because the disk fell behind
+  constexpr uint32_t MetadataOnly = 1;
+
+  struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;    // written after each entry, so a crash leaves a valid prefix
+    uint64_t runStart;      // recorder start (us since the epoch), same for every segment of a run
+  };
+
+  struct IndexEntry {
+    uint64_t offset;        // into the .mjpeg file
+    uint32_t size;          // 0 for metadata-only entries
+    uint32_t flags;
+    uint64_t captureTime;   // sink grab time (us)
+    uint8_t camId;
+    uint8_t reserved[7];
+  };
+}
+
+// Appends every grabbed MJPEG frame to memory-mapped segment files. The
+// collector only copies into a staging queue; a writer thread moves frames
+// to disk. When the writer falls behind frames are kept as metadata only;
+// frames too big for a segment, or arriving while segments can't be opened,
+// are dropped, and opening is retried with a growing delay.
+class FrameRecorder {
+  public:
+    FrameRecorder(std::string directory, uint8_t camId, size_t segmentBytes = 64 << 20);
+
+    ~FrameRecorder();
+
+    // Recorder counters
+    struct Stats {
+      uint64_t recorded = 0;
+      uint64_t metadataOnly = 0;
+      uint64_t dropped = 0;
+      uint64_t bytes = 0;
+      int segments = 0;
+    };
+
+    // Queue a grabbed frame, never blocks
+    void Record(const std::vector<uchar> &jpeg, uint64_t captureTime);
+
+    Stats GetStats();
+
+  private:
+    // A grab waiting to be written
+    struct Staged {
+      std::vector<uchar> jpeg;
+      uint64_t captureTime = 0;
+      bool metadataOnly = false;
+    };
+
+    // Move staged frames into the mapped segment
+    void WriterThread();
+
+    // Create, preallocate and map the next segment pair, false while backing off after a failure
+    bool OpenSegment();
+
+    // Trim the current segment to what was written and unmap it
+    void CloseSegment();
+
+    static constexpr int StagedCount = 64;
+    // Past this many queued frames new ones are staged without their bytes
+    static constexpr int PayloadLimit = 48;
+    static constexpr size_t IndexCapacity = 8192;
+    // Delay before opening again after a failed segment, doubling per failure in a row
+    static constexpr int RetryMinMs = 500;
+    static constexpr int RetryMaxMs = 30000;
+
+    std::string directory;
+    uint8_t camId = 0;
+    size_t segmentBytes = 0;
+    uint64_t runStart = 0;
+
+    Staged staged[StagedCount];
+    std::atomic<uint64_t> head = 0;   // next slot the collector fills
+    std::atomic<uint64_t> tail = 0;   // next slot the writer drains
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+
+    int segmentNumber = 0;  // segments opened by this recorder
+    int nextSegment = 0;    // number in the next segment's name, past any already in the directory
+    int dataFd = -1;
+    int indexFd = -1;
+    uchar *data = nullptr;
+    uchar *index = nullptr;
+    size_t dataUsed = 0;
+    uint32_t entryCount = 0;
+    int retryMs = 0;
+    std::chrono::steady_clock::time_point retryAt{};
+
+    std::atomic<uint64_t> recorded = 0;
+    std::atomic<uint64_t> metadataOnly = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> bytes = 0;
+
+    std::atomic<bool> running = true;
+    std::thread writer;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Fixed ring of frame slots handed between pipeline stages by sequence number.
+// The writer claims the oldest slot no stage is holding, fills it and publishes
+// it. Each stage waits for its input stage to publish a newer sequence, holds
+// the newest slot while it works on it and skips anything older. Slots are
+// reference counted and reused, so their buffers are never reallocated once
+// sized.
+template <typename T, int Stages, int SlotCount = 8>
+class FrameRing {
+  public:
+    struct Slot {
+      T data{};
+      std::atomic<uint64_t> seq{0};
+      std::atomic<int> holders{0};   // -1 while claimed by the writer
+    };
+
+    // Position of a single reader in the ring
+    struct Cursor {
+      uint64_t seq = 0;
+      std::atomic<uint64_t> dropped{0};
+    };
+
+    static constexpr int Size = SlotCount;
+
+    // Access a slot directly, only safe before the pipeline starts
+    Slot& At(int index) {
+      return slots[index];
+    }
+
+    // Claim the oldest slot nothing is holding for writing, nullptr if all are held
+    Slot* Claim() {
+      for(int attempt = 0; attempt < SlotCount; attempt++) {
+        Slot* oldest = nullptr;
+        for(Slot& slot : slots) {
+          if(slot.holders.load(std::memory_order_relaxed) != 0) continue;
+          if(!oldest || slot.seq.load(std::memory_order_relaxed) < oldest->seq.load(std::memory_order_relaxed)) {
+            oldest = &slot;
+          }
+        }
+        if(!oldest) break;
+        int expected = 0;
+        if(oldest->holders.compare_exchange_strong(expected, -1, std::memory_order_acquire)) {
+          TakeSlot();
+          return oldest;
+        }
+      }
+      exhausted.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    // Give up a claimed slot without publishing it
+    void Abandon(Slot* slot) {
+      slot->holders.store(0, std::memory_order_release);
+      inUse.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Publish a claimed slot as the first stage under a new sequence number
+    uint64_t Commit(Slot* slot) {
+      uint64_t seq = ++lastSeq;
+      slot->seq.store(seq, std::memory_order_relaxed);
+      slot->holders.store(0, std::memory_order_release);
+      inUse.fetch_sub(1, std::memory_order_relaxed);
+      Publish(0, slot);
+      return seq;
+    }
+
+    // Publish a held slot as the newest output of a stage and wake waiters
+    void Publish(int stage, Slot* slot) {
+      uint64_t packed = (slot->seq.load(std::memory_order_relaxed) << 8) | (uint64_t)(slot - slots);
+      latest[stage].store(packed, std::memory_order_release);
+      {
+        std::lock_guard<std::mutex> lock(waitMutex);
+      }
+      waitCondition.notify_all();
+    }
+
+    // Wait for a stage to publish past the cursor and hold its newest slot.
+    // Returns nullptr if nothing new arrives before the timeout.
+    Slot* WaitNewest(int stage, Cursor &cursor, std::chrono::milliseconds timeout) {
+      auto deadline = std::chrono::steady_clock::now() + timeout;
+      while(true) {
+        uint64_t packed = latest[stage].load(std::memory_order_acquire);
+        uint64_t seq = packed >> 8;
+        if(seq > cursor.seq) {
+          Slot* slot = &slots[packed & 0xff];
+          bool held = Hold(slot, seq);
+          if(cursor.seq) {
+            cursor.dropped.fetch_add(seq - cursor.seq - (held ? 1 : 0), std::memory_order_relaxed);
+          }
+          cursor.seq = seq;
+          if(held) return slot;
+          continue;   // slot was recycled before we got to it
+        }
+        std::unique_lock<std::mutex> lock(waitMutex);
+        bool advanced = waitCondition.wait_until(lock, deadline, [&] {
+          return (latest[stage].load(std::memory_order_acquire) >> 8) > cursor.seq;
+        });
+        if(!advanced) return nullptr;
+      }
+    }
+
+    // Wait until a stage has published at least seq, false on timeout
+    bool WaitFor(int stage, uint64_t seq, std::chrono::milliseconds timeout) {
+      std::unique_lock<std::mutex> lock(waitMutex);
+      return waitCondition.wait_for(lock, timeout, [&] { return GetLatestSeq(stage) >= seq; });
+    }
+
+    // Let go of a slot taken with WaitNewest
+    void Release(Slot* slot) {
+      if(slot->holders.fetch_sub(1, std::memory_order_release) == 1) {
+        inUse.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+
+    // Newest sequence number published by a stage
+    uint64_t GetLatestSeq(int stage) {
+      return latest[stage].load(std::memory_order_acquire) >> 8;
+    }
+
+    // Slots currently claimed or held by any stage
+    int GetInUse() {
+      return inUse.load(std::memory_order_relaxed);
+    }
+
+    // Most slots ever claimed or held at once
+    int GetHighWater() {
+      return highWater.load(std::memory_order_relaxed);
+    }
+
+    // Times the writer found every slot held
+    uint64_t GetExhausted() {
+      return exhausted.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // Take a reference on a slot if it still carries the expected sequence
+    bool Hold(Slot* slot, uint64_t seq) {
+      int holders = slot->holders.load(std::memory_order_relaxed);
+      while(holders >= 0) {
+        if(slot->holders.compare_exchange_weak(holders, holders + 1, std::memory_order_acquire)) {
+          if(holders == 0) TakeSlot();
+          if(slot->seq.load(std::memory_order_relaxed) == seq) return true;
+          Release(slot);
+          return false;
+        }
+      }
+      return false;
+    }
+
+    // Count a slot going from free to in use
+    void TakeSlot() {
+      int current = inUse.fetch_add(1, std::memory_order_relaxed) + 1;
+      int peak = highWater.load(std::memory_order_relaxed);
+      while(current > peak && !highWater.compare_exchange_weak(peak, current, std::memory_order_relaxed));
+    }
+
+    Slot slots[SlotCount];
+    std::atomic<uint64_t> latest[Stages]{};
+    uint64_t lastSeq = 0;
+
+    std::atomic<int> inUse{0};
+    std::atomic<int> highWater{0};
+    std::atomic<uint64_t> exhausted{0};
+
+    std::mutex waitMutex;
+    std::condition_variable waitCondition;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <cameraserver/CameraServer.h>
+#include <cscore_raw.h>
+
+#include <opencv2/core/core.hpp>
+
+// Where a Camera gets its frames from
+class FrameSource {
+  public:
+    virtual ~FrameSource() = default;
+
+    // Grab the next frame decoded to BGR, returns its time (us) or 0 on failure
+    virtual uint64_t GrabFrame(cv::Mat &frame) = 0;
+
+    // Grab the next frame's MJPEG bytes, returns its time (us) or 0 on failure
+    virtual uint64_t GrabJpeg(std::vector<uchar> &jpeg) = 0;
+
+    // Id reported for the camera
+    virtual uint8_t GetID() = 0;
+
+    // Whether frames arrive at their own pace; unpaced sources are throttled by the pipeline
+    virtual bool Paced() { return true; }
+
+    // Whether the source has no more frames to give
+    virtual bool Exhausted() { return false; }
+};
+
+// Live USB camera through cscore, id is handed out by whoever opened it
+class UsbFrameSource : public FrameSource {
+  public:
+    UsbFrameSource(cs::UsbCamera *cam, uint8_t id, cs::VideoMode config, bool rawCapture);
+
+    uint64_t GrabFrame(cv::Mat &frame) override;
+
+    uint64_t GrabJpeg(std::vector<uchar> &jpeg) override;
+
+    uint8_t GetID() override;
+
+  private:
+    cs::UsbCamera *cam = nullptr;
+    cs::CvSink sink;
+    cs::RawSink rawSink;
+    wpi::RawFrame rawFrame;
+    uint8_t id = -1;
+};
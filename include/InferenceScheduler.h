@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Shares one inference server between every camera. The server takes so many
+// requests at once; the scheduler hands those slots out by smooth weighted
+// round-robin among the cameras that have a frame waiting, so a busy camera
+// can't crowd out the rest. Everything but SetWeight runs on the reactor thread.
+class InferenceScheduler {
+  public:
+    // Send the client's newest waiting frame, false if it had none
+    using SendCallback = std::function<bool()>;
+
+    // Requests the client has in flight
+    using InFlightCallback = std::function<int()>;
+
+    // Requests the server may have in flight across every client
+    explicit InferenceScheduler(int capacity);
+
+    // Change the server's request capacity
+    void SetCapacity(int requests);
+
+    // Start handing slots to a client, key is the camera ID; window caps its own requests in flight
+    void Add(uint8_t key, int window, SendCallback send, InFlightCallback inFlight);
+
+    // Stop handing slots to a client
+    void Remove(uint8_t key);
+
+    // Set a client's share relative to the others (default 1), any thread. Kept across Remove and Add
+    void SetWeight(uint8_t key, double weight);
+
+    // Note a client has a new frame and hand out whatever slots are free
+    void Ready(uint8_t key);
+
+    // Hand out whatever slots are free, call when requests were answered or expired
+    void Dispatch();
+
+    // Requests in flight across every client
+    int GetInFlight();
+
+  private:
+    struct Client {
+      uint8_t key = 0;
+      int window = 1;
+      bool ready = false;   // notified of a frame since its last empty send
+      double credit = 0;    // smooth weighted round-robin balance
+      bool eligible = false;  // in the running for the slot being handed out
+      SendCallback send;
+      InFlightCallback inFlight;
+    };
+
+    // Client with a key, nullptr if it isn't added
+    Client* Find(uint8_t key);
+
+    int capacity;
+    std::vector<Client> clients;
+    std::atomic<double> weights[256];
+};
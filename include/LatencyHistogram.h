@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+// Log-linear latency histogram in the style of HdrHistogram. Each power of two
+// of microseconds is split into SubBuckets linear buckets, so a recorded value
+// lands within 1/SubBuckets of its bucket. Recording is a single relaxed
+// atomic add; percentiles come from the difference between two snapshots.
+class LatencyHistogram {
+  public:
+    static constexpr int SubBits = 4;
+    static constexpr int SubBuckets = 1 << SubBits;
+    static constexpr int MaxBits = 32;  // values past ~71 minutes share the last bucket
+    static constexpr int BucketCount = (MaxBits - SubBits + 1) * SubBuckets;
+
+    // Bucket counts copied out at one point in time
+    struct Counts {
+      uint64_t buckets[BucketCount] = {};
+    };
+
+    // Count one sample (us), safe from any thread
+    void Record(uint64_t us) {
+      buckets[Index(us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Copy the current counts
+    void Snapshot(Counts &counts) const {
+      for(int i = 0; i < BucketCount; i++) {
+        counts.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    // Samples counted between two snapshots
+    static uint64_t Total(const Counts &now, const Counts &before) {
+      uint64_t total = 0;
+      for(int i = 0; i < BucketCount; i++) total += now.buckets[i] - before.buckets[i];
+      return total;
+    }
+
+    // Value (us) below which fraction of the samples between two snapshots fall
+    static uint64_t Percentile(const Counts &now, const Counts &before, double fraction) {
+      uint64_t total = Total(now, before);
+      if(!total) return 0;
+      uint64_t target = std::max<uint64_t>(1, (uint64_t)(fraction * total + 0.5));
+      uint64_t seen = 0;
+      for(int i = 0; i < BucketCount; i++) {
+        seen += now.buckets[i] - before.buckets[i];
+        if(seen >= target) return Value(i);
+      }
+      return Value(BucketCount - 1);
+    }
+
+    // Bucket a value falls in
+    static int Index(uint64_t us) {
+      if(us < SubBuckets) return (int)us;
+      int msb = std::bit_width(us) - 1;
+      if(msb >= MaxBits) return BucketCount - 1;
+      int shift = msb - SubBits;
+      return (shift + 1) * SubBuckets + (int)((us >> shift) & (SubBuckets - 1));
+    }
+
+    // Middle of a bucket's range
+    static uint64_t Value(int index) {
+      if(index < SubBuckets) return index;
+      int shift = index / SubBuckets - 1;
+      uint64_t lower = (uint64_t)(SubBuckets + index % SubBuckets) << shift;
+      return lower + ((1ull << shift) >> 1);
+    }
+
+  private:
+    std::atomic<uint64_t> buckets[BucketCount] = {};
+};
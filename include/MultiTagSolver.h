@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <apriltag/frc/apriltag/AprilTagFieldLayout.h>
+#include <apriltag/frc/apriltag/AprilTagPoseEstimator.h>
+#include <frc/geometry/Pose3d.h>
+#include <frc/geometry/Transform3d.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+using namespace frc;
+
+// Solves one field-relative pose from every tag a camera sees in a frame
+class MultiTagSolver {
+  public:
+    MultiTagSolver(AprilTagFieldLayout layout, AprilTagPoseEstimator::Config intrinsics, Transform3d robotToCamera = {});
+
+    // Field-relative pose solved from one frame
+    struct FieldPose {
+      bool valid = false;
+      Pose3d camera;
+      Pose3d robot;
+      double reprojectionError = 0;   // RMS, pixels
+      double ambiguity = 0;           // best/alternate error, single-tag solves only
+      int tagCount = 0;
+    };
+
+    // Drop the observations of the previous frame
+    void Reset();
+
+    // Add a detected tag, corners in capture pixels in detection order
+    void AddTag(int id, const double corners[8]);
+
+    // Solve the camera pose from all tags added since Reset
+    FieldPose Solve();
+
+  private:
+    // Convert a field-to-camera PnP solution to a field pose
+    Pose3d ToFieldPose(const cv::Mat &rvec, const cv::Mat &tvec);
+
+    AprilTagFieldLayout layout;
+    Transform3d cameraToRobot;
+    double tagSize = 0;
+    cv::Mat cameraMatrix;
+    cv::Mat distortion;
+
+    // Single-tag solves above this ambiguity pick the solution nearest the last pose
+    const double ambiguityThreshold = 0.2;
+
+    std::vector<cv::Point3d> objectPoints;
+    std::vector<cv::Point2d> imagePoints;
+    int tagCount = 0;
+
+    Pose3d lastCamera;
+    bool hasLastCamera = false;
+
+    std::vector<cv::Mat> rvecs;
+    std::vector<cv::Mat> tvecs;
+    std::vector<double> errors;
+};
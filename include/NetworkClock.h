@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <networktables/NetworkTableInstance.h>
+
+// Local timestamps (us, the wpi::Now base cscore stamps grabs in) against the
+// NT server's time base, so the robot can line vision up with its own clock
+namespace NetworkClock {
+  // Follow the server time offset of an NT instance as it syncs
+  void Start(nt::NetworkTableInstance instance);
+
+  // Whether the server offset is known, until then times stay local. Once it is
+  // it stays known, a lost connection keeps converting with the last offset
+  bool Synced();
+
+  // Server time (us) of a local time
+  int64_t ToServerTime(int64_t localTime);
+
+  // Local time (us) of a server time, what NT publishers expect as a timestamp
+  int64_t ToLocalTime(int64_t serverTime);
+}
@@ -3,6 +3,7 @@
 #include <arpa/inet.h>
 #include <linux/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <iostream>
 #include <stdio.h>
@@ -20,6 +21,32 @@ namespace Networking {
   // Send datagram to provided address using provided socket
   int SendReceive(int sock, struct pollfd *fd, struct sockaddr_in *server_addr, uchar* req_buf, int reqSize, uchar* buf, int bufSize);
 
+  // Send every prepared datagram with as few syscalls as possible, returns how many went out
+  int SendBatch(int sock, struct mmsghdr *messages, int count);
+
+  // Wait up to timeoutMs for one datagram, returns its size or 0
+  int Receive(int sock, struct pollfd *fd, uchar* buf, int bufSize, int timeoutMs);
+
+  // Smoothed round-trip time and the reply timeout derived from it, RFC 6298 style
+  class RoundTrip {
+    public:
+      // Add a measured round trip (ms)
+      void Update(double ms);
+
+      // Note a reply that never came, backs the timeout off until the next sample
+      void TimedOut();
+
+      // How long to wait for a reply (ms)
+      int GetTimeoutMs();
+
+    private:
+      static constexpr int MinTimeoutMs = 20;
+      static constexpr int MaxTimeoutMs = 500;
+      double smoothed = 0;
+      double variance = 0;
+      int backoff = 1;
+  };
+
   constexpr uchar UdpSignature[4] = {0x5b, 0x20, 0xc4, 0x10};
 
   constexpr uchar DiscoverSignature[2] = {0x8e, 0x96};
@@ -4,7 +4,10 @@
 #include <linux/in.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include <opencv2/core/core.hpp>
@@ -13,41 +16,88 @@
 
 #include "Networking.h"
 #include "PeripherySession.h"
+#include "PeripheryReactor.h"
 
+// Command channel to the Periphery server. Every request is asynchronous:
+// commands queue up and go out one at a time on the reactor, and each
+// callback runs on the reactor thread once the reply arrives or times out.
 class PeripheryClient {
   public:
     PeripheryClient();
 
+    // Drive the command socket from a reactor, call before any request
+    void Attach(PeripheryReactor *reactor);
+
     // UDP Broadcast to find command socket
-    int GetCommandSocket();
+    void Discover(std::function<void(bool found)> done);
+
+    // Get available models on ML server, "NONE" if the request failed
+    void GetAvailableModels(std::function<void(std::string models)> done);
 
-    // Get available models on ML server
-    std::string GetAvailableModels();
-    
     // Change active model on server
-    bool SwitchModel(std::string modelName);
-    
-    // Create inference session
-    PeripherySession CreateInferenceSession();
-    
+    void SwitchModel(std::string modelName, std::function<void(bool success)> done);
+
+    // Create inference session, the session is invalid if the request failed
+    void CreateInferenceSession(std::function<void(PeripherySession session)> done);
+
+    // Try shared memory for new sessions when the server runs on this machine, UDP otherwise
+    void SetSharedMemory(bool enabled, size_t slotBytes);
+
     // Check if session is alive
-    bool SessionAvailable(uint32_t id);
+    void SessionAvailable(uint32_t id, std::function<void(bool alive)> done);
 
     // Check if the client is connected
     bool GetClientConnected();
 
+    // Commands queued or waiting for their reply, and new sessions still in their shared memory handshake
+    int GetPendingCommands();
+
   private:
+    // A request and what to do with its reply
+    struct Command {
+      std::vector<uchar> request;
+      size_t headerSize = 0;      // leading request bytes the reply echoes
+      sockaddr_in address;
+      int timeoutMs = 500;
+      std::function<void(const uchar *body, int size)> done;  // body is null on timeout
+    };
+
+    // Queue a command, sending it right away if nothing is outstanding
+    void Send(Command command);
+
+    // Send the next queued command
+    void SendNext();
+
+    // Finish the outstanding command with its reply body, or null on timeout
+    void Complete(const uchar *body, int size);
+
+    // Read replies off the command socket
+    void OnReadable();
+
+    // Offer a new session's frames to a server on this machine, done gets it on shared memory or UDP
+    void AttachSharedMemory(PeripherySession session, std::function<void(PeripherySession session)> done);
+
+    // Build a request of the two signatures plus payload
+    static std::vector<uchar> BuildRequest(const uchar *signature, const uchar *payload = nullptr, size_t payloadSize = 0);
+
     struct sockaddr_in server_address;
     int sock = -1;
-    struct pollfd fd;
     bool clientConnected = false;
+    bool sharedMemory = false;
+    size_t sharedSlotBytes = 0;
 
-    std::vector<PeripherySession> sessions;
+    PeripheryReactor *reactor = nullptr;
+    std::deque<Command> commands;   // front is outstanding while commandActive
+    bool commandActive = false;
+    uint64_t commandNumber = 0;     // tells a timeout which command it was set for
+    int pendingHandshakes = 0;      // sessions whose command is done but haven't been handed on yet
 
     const int COMMAND_PORT = 5800;
 
+    // How long a local server gets to take a shared ring before the session stays on UDP
+    static constexpr int SharedHandshakeMs = 200;
+
     // Max datagram length for image stream
     static const int MaxDatagram = 1024;
-    uchar request[PeripheryClient::MaxDatagram];
     uchar response[PeripheryClient::MaxDatagram];
   };
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// One epoll event loop for every Periphery socket. Handlers, posted tasks
+// and timers all run on the reactor thread, so they must never block.
+class PeripheryReactor {
+  public:
+    using Callback = std::function<void()>;
+
+    PeripheryReactor();
+
+    ~PeripheryReactor();
+
+    // Start the reactor thread
+    void Start();
+
+    // Stop and join the reactor thread
+    void Stop();
+
+    // Call onReadable on the reactor thread whenever fd has data
+    void Add(int fd, Callback onReadable);
+
+    // Stop watching fd, safe to call from its own handler
+    void Remove(int fd);
+
+    // Run a task on the reactor thread soon
+    void Post(Callback task);
+
+    // Run a task on the reactor thread and wait for it, runs inline when called from the reactor
+    void Invoke(Callback task);
+
+    // Run a task on the reactor thread once delay has passed
+    void After(std::chrono::milliseconds delay, Callback task);
+
+    // Whether the caller is running on the reactor thread
+    bool InReactor();
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    // A task waiting for its time
+    struct Timer {
+      Clock::time_point due;
+      uint64_t order = 0;   // keeps timers due at the same time in the order they were set
+      Callback task;
+      bool operator>(const Timer &other) const {
+        return due != other.due ? due > other.due : order > other.order;
+      }
+    };
+
+    // Event loop
+    void Run();
+
+    // Wake the reactor out of epoll_wait
+    void Wake();
+
+    static constexpr int MaxEvents = 16;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::thread thread;
+    std::atomic<bool> running = false;
+
+    // Reactor thread only
+    std::unordered_map<int, std::shared_ptr<Callback>> handlers;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    uint64_t timerOrder = 0;
+
+    // Handed over from other threads
+    std::mutex postedLock;
+    std::vector<Callback> posted;
+    std::vector<Timer> postedTimers;
+};
@@ -1,28 +1,123 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
+#include <vector>
+
 #include "Networking.h"
+#include "SharedFrameRing.h"
 
 class PeripherySession {
   public:
     PeripherySession(uint32_t id, struct sockaddr_in session_addr, bool correctlyConfigured = true);
     
-    // Representation of an ML detection
+    // One ML detection, keypoints point into the frame's Detections
     struct Detection {
         uint8_t label = 0;
         double x = 0;
         double y = 0;
         double width = 0;
         double height = 0;
-        std::vector<double> kps = {};
+        const double *kps = nullptr;
+        int kpsCount = 0;
+    };
+
+    // Every detection of one frame, kept as parallel arrays plus one keypoint array;
+    // clearing keeps the capacity, so refilling it for the next frame doesn't allocate
+    struct Detections {
+        std::vector<uint8_t> labels;
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> width;
+        std::vector<double> height;
+        std::vector<uint32_t> kpsStart;   // first keypoint value of each detection
+        std::vector<uint32_t> kpsCount;
+        std::vector<double> kps;
+        uint64_t captureTime = 0;   // capture time (us, NT server time) of the frame they were found in
+
+        int Size() const { return labels.size(); }
+        Detection Get(int index) const {
+            return {labels[index], x[index], y[index], width[index], height[index],
+                    kps.data() + kpsStart[index], (int)kpsCount[index]};
+        }
+        void Clear();
+        void Reserve(int detections, int keypoints);
+        // Multiply boxes and (x, y, confidence) keypoints into another image's pixels
+        void Scale(double scaleX, double scaleY);
+    };
+
+    // Detections returned for one frame
+    struct Result {
+        uint32_t seq = 0;
+        uint64_t captureTime = 0;
+        double roundTripMs = 0;
+        Detections detections;
+    };
+
+    // Unpack a reply body into detections, false if any length runs past size
+    static bool ParseDetections(const uchar *body, int size, Detections &detections);
+
+    // Timing of one inference request (ms)
+    struct Timing {
+        double sendMs = 0;      // handing every chunk to the kernel
+        size_t sendBytes = 0;   // frame bytes of the request
+        double receiveMs = 0;   // last chunk sent to result received
+        int timeoutMs = 0;      // reply timeout used, from the measured round trip
+        bool timedOut = false;  // a request expired on the last ExpireInFlight
     };
 
-    // Format given buffer into a Detection
-    static Detection ConstructDetection(uchar *buf);
-    
     // Return session ID
     uint32_t GetID();
 
-    std::vector<Detection> RunInference(cv::Mat frame);
+    // Move frames through a shared ring the server on this machine took, instead of UDP
+    void UseSharedMemory(std::shared_ptr<SharedFrameRing> ring);
+
+    // Whether frames go through shared memory instead of UDP
+    bool UsesSharedMemory();
+
+    // Socket or eventfd replies arrive on
+    int GetFd();
+
+    // Close the session socket, copies of the session share it
+    void Close();
+
+    // Timing of the latest send, reply and expiry
+    Timing GetLastTiming();
+
+    // Send a frame for inference, as raw pixels over shared memory or JPEG encoded over UDP;
+    // returns its sequence number, 0 if the window is full. The reply's boxes are multiplied by
+    // scale, so a frame shrunk before sending still answers in capture pixels
+    uint32_t SendInference(cv::Mat frame, uint64_t captureTime, cv::Size2d scale = {1, 1});
+
+    // Send a JPEG for inference as-is, skipping the encode
+    uint32_t SendInference(const uchar *jpeg, size_t size, uint64_t captureTime, cv::Size2d scale = {1, 1});
+
+    // Wait up to timeoutMs for the reply to any request in flight, in whatever order they come back
+    bool ReceiveInference(Result &result, int timeoutMs);
+
+    // Forget requests that outlived the reply timeout, returns how many
+    int ExpireInFlight();
+
+    // Time until the oldest request in flight expires (ms), 0 if none are
+    int GetNextExpiryMs();
+
+    // Requests sent and not yet answered or expired
+    int GetInFlight();
+
+    // Set how many requests may be in flight at once
+    void SetWindow(int requests);
+
+    // Replies that arrived for requests already expired or unknown
+    uint64_t GetStaleReplies();
+
+    // Replies dropped because their lengths didn't fit the bytes received
+    uint64_t GetMalformedReplies();
+
+    // Frames the kernel didn't take whole, they never went in flight
+    uint64_t GetSendFailures();
+
+    // Most requests that can be in flight at once
+    constexpr static int MaxInFlight = 8;
 
     bool valid = false;
 
@@ -33,8 +128,51 @@ class PeripherySession {
     int timeoutfd = -1;
     struct pollfd fd;
 
+    // A request waiting for its reply
+    struct Pending {
+        uint32_t seq = 0;   // 0 marks a free entry
+        uint64_t captureTime = 0;
+        cv::Size2d scale{1, 1};   // reply boxes are multiplied by this
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    // Write a frame into a free shared slot
+    uint32_t SendShared(SharedFrames::Format format, const cv::Mat &frame, const uchar *data, size_t size, uint64_t captureTime, cv::Size2d scale);
+
+    // Take one answered shared slot
+    bool ReceiveShared(Result &result, int timeoutMs);
+
+    // Remember a request until its reply or expiry
+    void TrackPending(uint32_t seq, uint64_t captureTime, cv::Size2d scale, size_t bytes, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point sent);
+
+    // Request a reply answers, null if it's stale
+    Pending* FindPending(uint32_t seq);
+
+    // Fill a result from its request and reply body
+    void CompleteResult(Pending &pending, const uchar *body, int size, Result &result);
+
+    // Signatures and session id, then sequence number (4) and capture time (8) echoed by the server
+    constexpr static int SeqOffset = sizeof(Networking::UdpSignature) + sizeof(Networking::InferenceSignature) + 4;
+    constexpr static int HeaderSize = SeqOffset + 4 + 8;
+
     // Max datagram length for image stream
     constexpr static int MaxDatagram = 49151;
-    uchar request[MaxDatagram];
     uchar response[MaxDatagram];
+    std::vector<uchar> encoded;   // reused between encoded frames
+
+    // Per-chunk datagrams for sendmmsg, grown to the largest frame seen
+    std::vector<uchar> chunkPrefixes;
+    std::vector<struct iovec> chunkVectors;
+    std::vector<struct mmsghdr> messages;
+
+    std::shared_ptr<SharedFrameRing> shared;   // set when frames go through shared memory
+    Networking::RoundTrip roundTrip;
+    Timing lastTiming;
+    Pending inFlight[MaxInFlight];
+    int window = 1;
+    uint32_t lastSeq = 0;
+    uint64_t staleReplies = 0;
+    uint64_t malformedReplies = 0;
+    uint64_t sendFailures = 0;
   };
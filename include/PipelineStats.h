@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <networktables/NetworkTable.h>
+#include <networktables/DoubleArrayTopic.h>
+
+#include "LatencyHistogram.h"
+
+// Per-stage latency histograms and throughput counters of one camera's
+// pipeline. Any thread may record; Publish is called from a single thread.
+class PipelineStats {
+  public:
+    // Timed pipeline stages
+    enum Stage {
+      kGrab = 0,
+      kConvert,
+      kDetect,
+      kEstimate,
+      kMotionGate,
+      kInference,
+      kInferenceQueue,
+      kInferenceSend,
+      kInferenceReceive,
+      kLabel,
+      kPost,
+      kPublish,
+      kStageCount
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    // Count one pass through a stage that took ms
+    void Record(Stage stage, double ms);
+
+    // Count one pass through a stage between two times
+    void Record(Stage stage, Clock::time_point start, Clock::time_point end);
+
+    // Set the running total of frames a stage dropped
+    void SetDropped(Stage stage, uint64_t total);
+
+    // Publish [fps, p50, p95, p99, max (ms), drops/s] per stage since the last call
+    void Publish(std::shared_ptr<nt::NetworkTable> table);
+
+    // Topic name of a stage
+    static const char* GetName(Stage stage);
+
+  private:
+    struct StageStats {
+      LatencyHistogram histogram;
+      std::atomic<uint64_t> dropped = 0;
+
+      // Publisher side only
+      LatencyHistogram::Counts previous;
+      LatencyHistogram::Counts current;
+      uint64_t previousDropped = 0;
+      nt::DoubleArrayPublisher publisher;
+    };
+
+    StageStats stages[kStageCount];
+    Clock::time_point lastPublish{};
+};
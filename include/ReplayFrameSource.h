@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "FrameSource.h"
+
+// Recorded frames played back from disk, either a directory of images, a
+// concatenated MJPEG stream, or FrameRecorder segments (one .mjpeg with its
+// .idx, or a directory of them). Timestamps (us, one per line in frame order)
+// are read from timestamps.txt inside the directory or <file>.timestamps next
+// to the stream, otherwise frames are spaced evenly at the given rate.
+// Recorder segments use the grab times from their index. A recording
+// directory holds every camera and run, so only one camera's run is played:
+// cam picks the camera (-1 for the lowest id) and run counts from the oldest,
+// or back from the latest when negative.
+class ReplayFrameSource : public FrameSource {
+  public:
+    ReplayFrameSource(std::string path, bool realTime, double fps = 30, int cam = -1, int run = -1);
+
+    uint64_t GrabFrame(cv::Mat &frame) override;
+
+    uint64_t GrabJpeg(std::vector<uchar> &jpeg) override;
+
+    uint8_t GetID() override;
+
+    // Real-time playback is paced by the recorded timestamps
+    bool Paced() override;
+
+    bool Exhausted() override;
+
+    // Number of frames loaded
+    size_t GetFrameCount();
+
+    // Size of the first frame
+    cv::Size GetFrameSize();
+
+  private:
+    struct RecordedFrame {
+      std::vector<uchar> jpeg;
+      uint64_t time = 0;
+      uint64_t offset = 0;  // playback time from the first frame (us)
+    };
+
+    // Load every image in a directory, in name order
+    void LoadDirectory(const std::string &path);
+
+    // Split a concatenated MJPEG stream into frames
+    void LoadMjpeg(const std::string &path);
+
+    // Load one camera's run of FrameRecorder segments, returns false if path has none
+    bool LoadRecordings(const std::string &path, int cam, int run);
+
+    // Apply recorded timestamps, filling gaps at the nominal frame rate
+    void LoadTimestamps(const std::string &path, uint64_t intervalUs);
+
+    // Take the next frame, waiting until it's due in real-time mode
+    RecordedFrame* NextFrame();
+
+    std::vector<RecordedFrame> frames;
+    std::atomic<size_t> next = 0;
+    bool realTime = false;
+    uint8_t camId = 0;
+    std::chrono::steady_clock::time_point started;
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+// Shared-memory frame slots between this process and a Periphery server on
+// the same machine. The client creates a memfd holding a RingHeader and
+// SlotCount slots, each a SlotHeader, a result area and a frame area, plus
+// two eventfds. It hands all three fds to the server over an abstract unix
+// socket. A frame is written into a slot once and the detections come back
+// in the same slot; eventfds wake each side. Layout is little-endian.
+namespace SharedFrames {
+  constexpr char Magic[8] = {'L', 'V', 'S', 'H', 'M', 'R', 'N', 'G'};
+  constexpr uint32_t Version = 1;
+
+  // Abstract unix socket the server listens on for handshakes
+  constexpr char SocketName[] = "periphery-shm";
+
+  // Bytes reserved in each slot for the reply body (same layout as a UDP reply after its header)
+  constexpr size_t ResultBytes = 16384;
+
+  // Slot ownership, only the owner writes a slot's contents
+  enum SlotState : uint32_t {
+    kFree = 0,      // client
+    kRequest,       // frame written, waiting for the server
+    kWorking,       // server
+    kResult         // result written, waiting for the client
+  };
+
+  // Pixel format of a slot's frame
+  enum Format : uint32_t {
+    kJpeg = 0,
+    kBGR,
+    kGray
+  };
+
+  struct RingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotCount;
+    uint64_t slotBytes;     // frame area of each slot
+  };
+
+  struct SlotHeader {
+    std::atomic<uint32_t> state;
+    uint32_t seq;
+    uint64_t captureTime;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t frameBytes;
+    uint32_t resultBytes;
+  };
+
+  // Sent with the three fds when a session attaches
+  struct Handshake {
+    char magic[8];
+    uint32_t sessionId;
+    uint32_t slotCount;
+    uint64_t slotBytes;
+  };
+}
+
+// One side's mapping of a shared frame ring
+class SharedFrameRing {
+  public:
+    ~SharedFrameRing();
+
+    // Create a ring and offer it to the local server for a session without waiting for the answer.
+    // Returns the socket the answer arrives on, -1 if no local server is listening
+    int Connect(uint32_t sessionId, int slotCount, size_t slotBytes);
+
+    // Read the server's answer once the socket from Connect is readable, false if it turned the ring down
+    bool FinishConnect();
+
+    // Map a ring received by the server side, takes ownership of the fds
+    bool Adopt(const SharedFrames::Handshake &handshake, int memoryFd, int requestFd, int resultFd);
+
+    // Slot header, result area and frame area of a slot
+    SharedFrames::SlotHeader* GetSlot(int index);
+    uchar* GetResult(int index);
+    uchar* GetFrame(int index);
+
+    // Wake the other side
+    void SignalRequest();
+    void SignalResult();
+
+    // Clear a wake-up once it's been seen
+    static void ClearSignal(int fd);
+
+    int GetSlotCount();
+    size_t GetSlotBytes();
+    int GetRequestFd();
+    int GetResultFd();
+
+  private:
+    // Map the memfd and check its header
+    bool Map();
+
+    // Close and unmap everything
+    void Release();
+
+    // Close the socket the handshake went over
+    void CloseHandshake();
+
+    // Offset of a slot from the start of the mapping
+    size_t SlotOffset(int index);
+
+    int handshakeFd = -1;   // open until the server answers
+    int memoryFd = -1;
+    int requestFd = -1;     // client to server
+    int resultFd = -1;      // server to client
+    uchar *base = nullptr;
+    size_t mappedBytes = 0;
+    int slotCount = 0;
+    size_t slotBytes = 0;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Newest-value handoff from one writer thread to one reader thread. The writer
+// fills its own copy and swaps it in whole, the reader takes the newest
+// complete one, so a reader never sees a half-written value. Three copies
+// rotate so neither side waits on the other; once their buffers have grown
+// nothing allocates.
+template <typename T>
+class SnapshotBuffer {
+  public:
+    // Set up every copy, call before either side starts
+    template <typename F>
+    void Prepare(F prepare) {
+      for(T &copy : copies) prepare(copy);
+    }
+
+    // Copy the writer fills next, writer thread only. It holds stale contents, overwrite all of it
+    T& Back() {
+      return copies[back];
+    }
+
+    // Hand the back copy to the reader, returns its generation
+    uint64_t Publish() {
+      int previous = shared.exchange(back | Fresh, std::memory_order_acq_rel);
+      back = previous & IndexMask;
+      return generation.fetch_add(1, std::memory_order_release) + 1;
+    }
+
+    // Move to the newest published copy, false if nothing was published since; reader thread only
+    bool Acquire() {
+      if(!(shared.load(std::memory_order_relaxed) & Fresh)) return false;
+      int previous = shared.exchange(front, std::memory_order_acq_rel);
+      front = previous & IndexMask;
+      return true;
+    }
+
+    // Copy the reader holds, reader thread only
+    const T& Front() {
+      return copies[front];
+    }
+
+    // Times the writer has published
+    uint64_t GetGeneration() {
+      return generation.load(std::memory_order_acquire);
+    }
+
+  private:
+    static constexpr int IndexMask = 3;
+    static constexpr int Fresh = 4;   // set on the shared index when the reader hasn't taken it
+
+    T copies[3];
+    int back = 0;
+    std::atomic<int> shared = 1;
+    int front = 2;
+    std::atomic<uint64_t> generation = 0;
+};
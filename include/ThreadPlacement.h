@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <networktables/NetworkTable.h>
+
+// Names pipeline threads and places them on cores by role. Latency-critical
+// stages (grab, decode, detect, publish) share a set of cores of their own at
+// raised priority, everything else stays off those cores at lowered priority
+// and the shared ML reactor keeps a core clear of both. Each thread places
+// itself when it starts; until Configure is called threads are only named.
+namespace ThreadPlacement {
+  // What a thread is for
+  enum Role {
+    kLatency,       // on the path from grab to published detections
+    kBestEffort,    // labelling, streaming, ML encoding, housekeeping
+    kReactor        // the shared ML reactor, every session's I/O and the tracker
+  };
+
+  // Where and how each role runs
+  struct Policy {
+    std::vector<int> latencyCores;      // empty leaves affinity alone
+    std::vector<int> bestEffortCores;
+    std::vector<int> reactorCores;
+    int realtimePriority = 0;           // SCHED_FIFO priority of latency threads, 0 uses latencyNice instead
+    int latencyNice = -10;
+    int bestEffortNice = 10;
+    int reactorNice = 0;
+  };
+
+  // The reactor on the first core, best-effort threads on the next quarter of the
+  // cores and latency threads on the rest. The first core also stays free of
+  // SCHED_FIFO for the unplaced cscore and NT threads
+  Policy DefaultPolicy();
+
+  // Set the policy threads place themselves by and start placing them, call before any thread starts
+  void Configure(Policy policy);
+
+  // Name the calling thread (15 characters at most) and place it by role
+  void Apply(const std::string &name, Role role);
+
+  // Print every placed thread with its cores and scheduling
+  void PrintLayout();
+
+  // Publish each placed thread's [CPU %, core it last ran on] since the last call under table
+  void PublishUsage(std::shared_ptr<nt::NetworkTable> table);
+}
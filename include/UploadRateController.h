@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+// Picks the JPEG quality and downscale of ML uploads so a session holds its
+// bytes-per-second budget. Settings step down a ladder as soon as a window runs
+// over budget or uploads back up in the socket, and climb back one step after
+// several windows with plenty of headroom. Quality goes before resolution, and
+// frames are never held back, so congestion costs detail instead of inference rate.
+class UploadRateController {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // How to encode an upload
+    struct Setting {
+      int quality = 0;    // JPEG quality, 0 sends the camera's own JPEG untouched
+      int scale = 1;      // downscale divisor, 1, 2 or 4
+    };
+
+    // Bytes per second the session may upload, 0 turns the controller off
+    void SetBudget(double bytesPerSecond);
+
+    // Whether a budget is set
+    bool Enabled();
+
+    // Setting for the next upload
+    Setting GetSetting();
+
+    // Count one upload of bytes that took uploadMs to hand to the kernel
+    void Record(size_t bytes, double uploadMs);
+
+    // Step on the ladder, 0 is full quality; any thread
+    int GetLevel();
+
+    // Upload rate over the last window (bytes/s); any thread
+    double GetBytesPerSecond();
+
+  private:
+    static constexpr Setting Levels[] = {
+      {0, 1}, {85, 1}, {75, 1}, {65, 1},
+      {80, 2}, {70, 2}, {60, 2}, {50, 2},
+      {70, 4}, {50, 4}
+    };
+    static constexpr int LevelCount = sizeof(Levels) / sizeof(Levels[0]);
+
+    // Length of a measuring window
+    const std::chrono::milliseconds window{500};
+
+    // Handing a frame to the kernel takes longer than this once the socket buffer backs up (ms)
+    const double uploadTargetMs = 4.0;
+
+    // Fraction of the budget a window must stay under to count toward stepping up
+    const double raiseHeadroom = 0.6;
+
+    // Quiet windows in a row before stepping up
+    const int raiseWindows = 4;
+
+    double budget = 0;
+    Clock::time_point windowStart{};
+    size_t windowBytes = 0;
+    double windowUploadMs = 0;
+    int windowUploads = 0;
+    int quietWindows = 0;
+    std::atomic<int> level = 0;
+    std::atomic<double> bytesPerSecond = 0;
+};
@@ -1,21 +1,51 @@
 #include "Camera.h"
 
-Camera::Camera(cs::UsbCamera *camRef, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig) 
-  : estimator{estConfig} {
-  cam = camRef;
+Camera::Camera(cs::UsbCamera *cam, uint8_t camId, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, CaptureMode mode)
+  : Camera(std::make_unique<UsbFrameSource>(cam, camId, config, mode != CaptureMode::kBGR), config, estConfig, mode) {
+  source = new cs::CvSource{"source" + std::to_string(id), config};
+  frc::CameraServer::StartAutomaticCapture(*source);
+}
+
+Camera::Camera(std::unique_ptr<FrameSource> frames, cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, CaptureMode mode) 
+  : estimator{ScaleEstimatorConfig(estConfig, GetGrayScale(mode))} {
+  frameSource = std::move(frames);
+  intrinsics = estConfig;
+  captureMode = mode;
+  grayScale = GetGrayScale(mode);
+  captureSize = {config.width, config.height};
   // Configure AprilTag detector
   detector.AddFamily("tag36h11");
-  detector.SetConfig({});
+  detector.SetConfig(tuner.GetConfig());
   auto quadParams = detector.GetQuadThresholdParameters();
   quadParams.minClusterPixels = 3;
   detector.SetQuadThresholdParameters(quadParams);
 
-  auto info = cam->GetInfo();
-  id = info.dev;
-  sink = new cs::CvSink{frc::CameraServer::GetVideo(*cam)};
-  source = new cs::CvSource{"source" + id, config};
-  cam->SetVideoMode(config);
-  frc::CameraServer::StartAutomaticCapture(*source);
+  id = frameSource->GetID();
+
+  // Size every pooled frame up front so the pipeline never allocates
+  for(int i = 0; i < Ring::Size; i++) {
+    Frame &slot = ring.At(i).data;
+    slot.frame.create(config.height, config.width, CV_8UC3);
+    slot.gray.create((config.height + grayScale - 1) / grayScale, (config.width + grayScale - 1) / grayScale, CV_8UC1);
+    slot.labelled.create(config.height, config.width, CV_8UC3);
+  }
+  inferenceResult.detections.Reserve(MaxMLDetections, MaxMLDetections * MaxMLKeypoints);
+  mlTracked.Reserve(MaxMLDetections, MaxMLDetections * MaxMLKeypoints);
+  mlTrackIds.reserve(MaxMLDetections);
+  mlPredicted.reserve(MaxMLDetections);
+  auto reserve = [](MLSnapshot &snapshot) {
+    snapshot.detections.Reserve(MaxMLDetections, MaxMLDetections * MaxMLKeypoints);
+    snapshot.trackIds.reserve(MaxMLDetections);
+    snapshot.predicted.reserve(MaxMLDetections);
+  };
+  mlSnapshots.Prepare(reserve);
+  labelSnapshots.Prepare(reserve);
+}
+
+Camera::~Camera() {
+  StopInferencing();
+  StopStream();
+  delete source;
 }
 
 uint8_t Camera::GetID() {
@@ -23,30 +53,34 @@ uint8_t Camera::GetID() {
 }
 
 std::vector<uint8_t> Camera::GetTargetTags() {
-  return targetTags;
+  std::vector<uint8_t> targets;
+  for(int id = 0; id < 256; id++) {
+    if(targetTags[id / 64].load(std::memory_order_relaxed) & (1ull << (id % 64))) targets.push_back(id);
+  }
+  return targets;
 }
 
 void Camera::SetTargetTags(std::vector<uint8_t> targets) {
-  targetTags = targets;
-}
-
-std::vector<Camera::TagDetection>* Camera::GetTagDetections() {
-  return &tagDetections;
+  uint64_t mask[4] = {};
+  for(uint8_t id : targets) mask[id / 64] |= 1ull << (id % 64);
+  for(int i = 0; i < 4; i++) targetTags[i].store(mask[i], std::memory_order_relaxed);
 }
 
-int Camera::GetTagDetectionCount() {
-  return tagDetectionCount;
+const Camera::TagSnapshot& Camera::GetTagSnapshot() {
+  tagSnapshots.Acquire();
+  return tagSnapshots.Front();
 }
 
-std::vector<PeripherySession::Detection>* Camera::GetMLDetections() {
-  return &mlDetections;
+const Camera::MLSnapshot& Camera::GetMLSnapshot() {
+  mlSnapshots.Acquire();
+  return mlSnapshots.Front();
 }
 
-int Camera::GetMLDetectionCount() {
-  return mlDetectionCount;
+void Camera::SetDetectionsCallback(std::function<void()> callback) {
+  detectionsCallback = callback;
 }
 
-uint32_t Camera::GetCaptureTime() {
+uint64_t Camera::GetCaptureTime() {
   return captureTime;
 }
 
@@ -61,50 +95,151 @@ void Camera::ResumeTagDetection() {
 }
 
 // Draw AprilTag outline onto provided frame
-void Camera::DrawAprilTagBox(cv::Mat frame, TagDetection* tag) {
+void Camera::DrawAprilTagBox(cv::Mat frame, TagDetection* tag, double scale) {
   // Draw boxes around tags for video feed                
   for(int i = 0; i < 4; i++) {
       auto point1 = tag->corners[i];
       int secondIndex = i == 3 ? 0 : i + 1;   // out of bounds adjust for last iteration
       auto point2 = tag->corners[secondIndex];
-      cv::Point lineStart{(int)point1.x, (int)point1.y};
-      cv::Point lineEnd{(int)point2.x, (int)point2.y};
+      cv::Point lineStart{(int)(point1.x * scale), (int)(point1.y * scale)};
+      cv::Point lineEnd{(int)(point2.x * scale), (int)(point2.y * scale)};
       cv::line(frame, lineStart, lineEnd, cv::Scalar(0, 0, 255), 2, cv::LINE_4);
   }
 }
 
 // Draw ML inference outlines onto provided frame
-void Camera::DrawInferenceBox(cv::Mat frame, std::vector<PeripherySession::Detection> &detections) {
-  for (auto& detection : detections) {
-    cv::Rect rect(detection.x, detection.y, detection.width, detection.height);
+void Camera::DrawInferenceBox(cv::Mat frame, const PeripherySession::Detections &detections, double scale) {
+  for(int d = 0; d < detections.Size(); d++) {
+    PeripherySession::Detection detection = detections.Get(d);
+    cv::Rect rect(detection.x * scale, detection.y * scale, detection.width * scale, detection.height * scale);
     auto color = cv::Scalar((detection.label == 0) * 255, (detection.label == 1) * 255, (detection.label == 2) * 255);
     cv::rectangle(frame, rect, color, 2, cv::LINE_4);
-    for(int i = 0; i < detection.kps.size(); i += 3) {
-      cv::Point center(detection.kps[i], detection.kps[i+1]);
+    for(int i = 0; i + 2 < detection.kpsCount; i += 3) {
+      cv::Point center(detection.kps[i] * scale, detection.kps[i+1] * scale);
       cv::circle(frame, center, detection.kps[i+2]*4, cv::Scalar(0, 0, 255), cv::FILLED, cv::LINE_8);
     }
   }
 }
 
+void Camera::SetStreamLimits(double fps, int scale) {
+  streamFps = std::max(0.0, fps);
+  streamScale = std::clamp(scale, 1, 8);
+}
+
 bool Camera::ValidPresent() {
-  return newFrame && validFrame;
+  return validFrame;
+}
+
+Camera::DroppedFrames Camera::GetDroppedFrames() {
+  return {
+    converterCursor.dropped.load(),
+    processorCursor.dropped.load(),
+    labellerCursor.dropped.load(),
+    posterCursor.dropped.load(),
+    mlCursor.dropped.load() + mlEncodeCursor.dropped.load()
+  };
+}
+
+Camera::PoolStats Camera::GetPoolStats() {
+  return {
+    Ring::Size,
+    ring.GetInUse(),
+    ring.GetHighWater(),
+    ring.GetExhausted(),
+    reallocations.load()
+  };
+}
+
+// Count pooled buffers that had to be reallocated, these should stay at zero
+void Camera::TrackReallocation(const cv::Mat &mat, const uchar *previous) {
+  if(mat.data != previous) reallocations++;
+}
+
+// Decode the colour image of a raw-grabbed frame the first time a stage asks for it
+cv::Mat& Camera::GetColorFrame(Frame &data) {
+  std::lock_guard<std::mutex> lock(data.colorLock);
+  if(!data.colorReady) {
+    const uchar *pooled = data.frame.data;
+    cv::Mat encoded(1, (int)data.jpeg.size(), CV_8UC1, data.jpeg.data());
+    cv::imdecode(encoded, cv::IMREAD_COLOR, &data.frame);
+    TrackReallocation(data.frame, pooled);
+    data.colorReady = true;
+  }
+  return data.frame;
+}
+
+// Whether a frame's BGR image is already decoded
+bool Camera::HasColorFrame(Frame &data) {
+  std::lock_guard<std::mutex> lock(data.colorLock);
+  return data.colorReady;
+}
+
+int Camera::GetGrayScale(CaptureMode mode) {
+  switch(mode) {
+    case CaptureMode::kGrayHalf: return 2;
+    case CaptureMode::kGrayQuarter: return 4;
+    default: return 1;
+  }
+}
+
+// Detections on a downscaled gray image need intrinsics in the same pixel units
+AprilTagPoseEstimator::Config Camera::ScaleEstimatorConfig(AprilTagPoseEstimator::Config config, int scale) {
+  config.fx /= scale;
+  config.fy /= scale;
+  config.cx /= scale;
+  config.cy /= scale;
+  return config;
+}
+
+uint64_t Camera::GetStageSeq(Stage stage) {
+  return ring.GetLatestSeq(stage);
+}
+
+void Camera::SetFrameCallback(std::function<void(Frame&)> callback) {
+  frameCallback = callback;
+}
+
+// Stamp a frame leaving a stage and hand it to whoever waits on that stage
+void Camera::PublishStage(Stage stage, Ring::Slot* slot) {
+  slot->data.stageDone[stage] = std::chrono::steady_clock::now();
+  if(stage == kCaptured) {
+    ring.Commit(slot);
+  } else {
+    ring.Publish(stage, slot);
+  }
 }
 
 void Camera::StartStream() {
   std::cout << "Starting Capture for Cam " << (int)id << std::endl;
+  running = true;
   collector = std::move(std::thread(&Camera::StartCollector, this));
   converter = std::move(std::thread(&Camera::StartGrayscaleConverter, this));
   processor = std::move(std::thread(&Camera::StartProcessor, this));
   labeller = std::move(std::thread(&Camera::StartLabeller, this));
-  poster = std::move(std::thread(&Camera::StartPosting, this));
+  mlEncoder = std::move(std::thread(&Camera::StartMLEncoder, this));
+  if(source) {
+    poster = std::move(std::thread(&Camera::StartPosting, this));
+  }
+}
+
+void Camera::StopStream() {
+  running = false;
+  for(std::thread *thread : {&collector, &converter, &processor, &labeller, &mlEncoder, &poster}) {
+    if(thread->joinable()) thread->join();
+  }
+}
+
+// Name and place the calling pipeline thread
+void Camera::PlaceThread(const char *stage, ThreadPlacement::Role role) {
+  ThreadPlacement::Apply("cam" + std::to_string(id) + "-" + stage, role);
 }
 
 void Camera::StartCollector() {
-  while(true) {
-    if(newFrame && !framePosted) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(threadDelay));
-      continue;
-    }
+  PlaceThread("grab", ThreadPlacement::kLatency);
+  cv::Mat discard{};
+  std::vector<uchar> discardJpeg{};
+  uint64_t committed = 0;
+  while(running && !frameSource->Exhausted()) {
     // Get the current time from the system clock
     auto now = std::chrono::system_clock::now();
 
@@ -117,128 +252,733 @@ void Camera::StartCollector() {
     if(lastFail && milliseconds - lastFail > 3000) {
       continue;
     }
-    auto success = sink->GrabFrame(frame);
+    // Sources that don't pace themselves stay one frame ahead of detection
+    if(!frameSource->Paced() && committed > 1 && !ring.WaitFor(kProcessed, committed - 1, frameTimeout)) {
+      continue;
+    }
+    // Recording and ML pass-through need the camera's own bytes, BGR is then decoded by the converter
+    bool rawGrab = captureMode != CaptureMode::kBGR || recorder || mlSessionAvailable;
+    Ring::Slot* slot = ring.Claim();
+    if(slot == nullptr) {
+      // Every slot is held downstream, keep the camera drained anyway
+      if(!rawGrab) {
+        frameSource->GrabFrame(discard);
+      } else {
+        uint64_t time = frameSource->GrabJpeg(discardJpeg);
+        if(time && recorder) recorder->Record(discardJpeg, time);
+      }
+      continue;
+    }
+    slot->data.grabStarted = std::chrono::steady_clock::now();
+    uint64_t success = 0;
+    bool empty = true;
+    if(!rawGrab) {
+      const uchar *pooled = slot->data.frame.data;
+      success = frameSource->GrabFrame(slot->data.frame);
+      TrackReallocation(slot->data.frame, pooled);
+      empty = slot->data.frame.empty();
+      slot->data.jpeg.clear();
+      slot->data.colorReady = true;
+    } else {
+      success = frameSource->GrabJpeg(slot->data.jpeg);
+      empty = slot->data.jpeg.empty();
+      slot->data.colorReady = false;
+      if(success && recorder) recorder->Record(slot->data.jpeg, success);
+    }
     if(success == 0) {
+      failedGrabs++;
       lastFail = milliseconds;
     } else {
       lastFail = 0;
     }
-    validFrame = !lastFail && !frame.empty();
+    validFrame = !lastFail && !empty;
     if(validFrame) {
-      captureTime = milliseconds + success;
-      newFrame = true;
-      grayAvailable = false;
-      frameLabelled = false;
-      frameProcessed = false;
-      framePosted = false;
+      // Base before stamp, a reader that sees the new stamp sees its base too
+      slot->data.serverTime = NetworkClock::Synced();
+      slot->data.captureTime = NetworkClock::ToServerTime(success);
+      captureServerTime = slot->data.serverTime;
+      captureTime = slot->data.captureTime;
+      stats.Record(PipelineStats::kGrab, slot->data.grabStarted, std::chrono::steady_clock::now());
+      PublishStage(kCaptured, slot);
+      committed = ring.GetLatestSeq(kCaptured);
+      if(mlInputStage == kCaptured) NotifyInference();
+    } else {
+      ring.Abandon(slot);
     }
   }
 }
 
 void Camera::StartGrayscaleConverter() {
-  while(true) {
-    if(!ValidPresent()) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(threadDelay));
-      continue;
+  PlaceThread("convert", ThreadPlacement::kLatency);
+  while(running) {
+    Ring::Slot* slot = ring.WaitNewest(kCaptured, converterCursor, frameTimeout);
+    if(slot == nullptr) continue;
+    auto start = std::chrono::steady_clock::now();
+    const uchar *pooled = slot->data.gray.data;
+    if(captureMode == CaptureMode::kBGR) {
+      cv::cvtColor(GetColorFrame(slot->data), slot->data.gray, cv::COLOR_BGR2GRAY);
+    } else {
+      // libjpeg skips chroma and scales in the DCT for the reduced modes
+      int flags = captureMode == CaptureMode::kGrayHalf ? cv::IMREAD_REDUCED_GRAYSCALE_2
+        : captureMode == CaptureMode::kGrayQuarter ? cv::IMREAD_REDUCED_GRAYSCALE_4
+        : cv::IMREAD_GRAYSCALE;
+      cv::Mat encoded(1, (int)slot->data.jpeg.size(), CV_8UC1, slot->data.jpeg.data());
+      cv::imdecode(encoded, flags, &slot->data.gray);
+    }
+    TrackReallocation(slot->data.gray, pooled);
+    if(mlInputStage == kConverted) {
+      cv::Size thumbnail(MotionThumbnailWidth, std::max(1, MotionThumbnailWidth * slot->data.gray.rows / slot->data.gray.cols));
+      cv::resize(slot->data.gray, slot->data.motion, thumbnail, 0, 0, cv::INTER_AREA);
+    }
+    stats.Record(PipelineStats::kConvert, start, std::chrono::steady_clock::now());
+    PublishStage(kConverted, slot);
+    ring.Release(slot);
+    if(mlInputStage == kConverted) NotifyInference();
+  }
+}
+
+// Detect requested tags inside a region of the gray image
+void Camera::DetectTags(cv::Mat &gray, cv::Rect region, std::vector<TagDetection> &tags) {
+  cv::Mat roi = gray(region);
+  auto start = std::chrono::steady_clock::now();
+  auto aprilTags = detector.Detect(roi.cols, roi.rows, (int)roi.step, roi.data);
+  frameDetectMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  for(const frc::AprilTagDetection* tag : aprilTags) {
+    uint8_t id = tag->GetId();
+    bool found = targetTags[id / 64].load(std::memory_order_relaxed) & (1ull << (id % 64));
+    if(!found && !fieldSolver) continue;  // tag not in request array, skip
+
+    // Shift corners from region to full image pixels
+    double corners[8];
+    tag->GetCorners(corners);
+    for(int i = 0; i < 8; i += 2) {
+      corners[i] += region.x;
+      corners[i+1] += region.y;
+    }
+
+    // Remember where the tag was for the next frame
+    TrackedTag tracked{id, corners[0], corners[1], corners[0], corners[1]};
+    double captureCorners[8];
+    for(int i = 0; i < 8; i += 2) {
+      tracked.minX = std::min(tracked.minX, corners[i]);
+      tracked.maxX = std::max(tracked.maxX, corners[i]);
+      tracked.minY = std::min(tracked.minY, corners[i+1]);
+      tracked.maxY = std::max(tracked.maxY, corners[i+1]);
+      captureCorners[i] = corners[i] * grayScale;
+      captureCorners[i+1] = corners[i+1] * grayScale;
+    }
+    foundTags.push_back(tracked);
+
+    // Every tag on the field feeds the field pose, requested or not
+    if(fieldSolver) {
+      fieldSolver->AddTag(id, captureCorners);
     }
-    if(!grayAvailable) {
-      cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
-      if(!mlFrameAvailable) {
-        mlFrame = frame.clone();
-        mlFrameAvailable = true;
+    if(!found) continue;
+
+    auto h = tag->GetHomography();
+    double homography[9] = {
+      h[0] + region.x * h[6], h[1] + region.x * h[7], h[2] + region.x * h[8],
+      h[3] + region.y * h[6], h[4] + region.y * h[7], h[5] + region.y * h[8],
+      h[6], h[7], h[8]
+    };
+    auto estimateStart = std::chrono::steady_clock::now();
+    auto transform = estimator.Estimate(homography, corners);  // Estimate Transform3d of tag
+    frameEstimateMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - estimateStart).count();
+
+    // Generate rectangle for labelling tag in capture pixels
+    std::vector<AprilTagDetection::Point> points;
+    for(int i = 0; i < 8; i += 2) {
+      points.push_back({captureCorners[i], captureCorners[i+1]});
+    }
+    TagDetection data{id, points, transform};
+    tags.push_back(data);
+  }
+}
+
+// Build padded search regions around where tracked tags should be this frame
+void Camera::BuildTrackingRegions(cv::Size size) {
+  trackingRegions.clear();
+  for(TrackedTag &tag : trackedTags) {
+    double padX = trackingPadding * (tag.maxX - tag.minX) + std::abs(tag.velocityX);
+    double padY = trackingPadding * (tag.maxY - tag.minY) + std::abs(tag.velocityY);
+    int x1 = std::max(0, (int)(tag.minX + tag.velocityX - padX));
+    int y1 = std::max(0, (int)(tag.minY + tag.velocityY - padY));
+    int x2 = std::min(size.width, (int)(tag.maxX + tag.velocityX + padX) + 1);
+    int y2 = std::min(size.height, (int)(tag.maxY + tag.velocityY + padY) + 1);
+    if(x2 <= x1 || y2 <= y1) continue;
+    trackingRegions.push_back({x1, y1, x2 - x1, y2 - y1});
+  }
+
+  // Merge overlapping regions so no tag is detected twice
+  bool merged = true;
+  while(merged) {
+    merged = false;
+    for(size_t i = 0; i < trackingRegions.size() && !merged; i++) {
+      for(size_t j = i + 1; j < trackingRegions.size(); j++) {
+        cv::Rect &a = trackingRegions[i];
+        cv::Rect &b = trackingRegions[j];
+        if((a & b).area() == 0) continue;
+        a = a | b;
+        trackingRegions.erase(trackingRegions.begin() + j);
+        merged = true;
+        break;
       }
-      labelled = frame.clone();
-      grayAvailable = true;
     }
   }
 }
 
 void Camera::StartProcessor() {
-  while(true) {
-    if(!ValidPresent() || !grayAvailable) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(threadDelay));
-      continue;
-    }
-    if(!frameProcessed) {
-      if(!pauseTagDetections) {
-        tagDetections.clear();
+  PlaceThread("detect", ThreadPlacement::kLatency);
+  while(running) {
+    Ring::Slot* slot = ring.WaitNewest(kConverted, processorCursor, frameTimeout);
+    if(slot == nullptr) continue;
+    cv::Mat &gray = slot->data.gray;
+    std::vector<TagDetection> &tags = slot->data.tags;
+    tags.clear();
+    foundTags.clear();
+    if(fieldSolver) fieldSolver->Reset();
+    frameDetectMs = 0;
+    frameEstimateMs = 0;
+
+    // Search only around last frame's tags, with a periodic full scan for new ones
+    bool fullScan = !tagTracking || trackedTags.empty() || ++framesSinceFullScan >= fullScanInterval;
+    if(!fullScan) {
+      BuildTrackingRegions(gray.size());
+      for(cv::Rect &region : trackingRegions) {
+        DetectTags(gray, region, tags);
+      }
+      // A tracked tag went missing, look for it everywhere
+      for(TrackedTag &tag : trackedTags) {
+        bool seen = false;
+        for(TrackedTag &found : foundTags) seen |= found.id == tag.id;
+        fullScan |= !seen;
+      }
+      if(fullScan) {
+        tags.clear();
+        foundTags.clear();
+        if(fieldSolver) fieldSolver->Reset();
       }
-      auto aprilTags = frc::AprilTagDetect(detector, gray);
-      for(const frc::AprilTagDetection* tag : aprilTags) {
-        uint8_t id = tag->GetId();
-        uint8_t found = count(targetTags.begin(), targetTags.end(), id);
-        if(!found) continue;  // tag not in request array, skip
-        auto transform = estimator.Estimate(*tag);  // Estimate Transform3d of tag
-        std::vector<AprilTagDetection::Point> corners;
-        // Generate rectangle for labelling tag 
-        for(int i = 0; i < 4; i++) {
-            auto point = tag->GetCorner(i);
-            corners.push_back(point);
-        }
-        if(!pauseTagDetections) {
-          TagDetection data{id, corners, transform};
-          tagDetections.push_back(data);
-        }
+    }
+    if(fullScan) {
+      framesSinceFullScan = 0;
+      DetectTags(gray, {0, 0, gray.cols, gray.rows}, tags);
+    }
+
+    // Carry motion forward so the next search region leads the tag
+    for(TrackedTag &found : foundTags) {
+      for(TrackedTag &previous : trackedTags) {
+        if(previous.id != found.id) continue;
+        found.velocityX = (found.minX + found.maxX - previous.minX - previous.maxX) / 2;
+        found.velocityY = (found.minY + found.maxY - previous.minY - previous.maxY) / 2;
       }
-      tagDetectionCount = tagDetections.size();
-      frameProcessed = true;
     }
+    trackedTags.swap(foundTags);
+
+    // One field-relative pose from every tag in view
+    if(fieldSolver) {
+      auto solveStart = std::chrono::steady_clock::now();
+      slot->data.fieldPose = fieldSolver->Solve();
+      frameEstimateMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - solveStart).count();
+      PublishFieldPose(slot->data);
+    }
+    stats.Record(PipelineStats::kDetect, frameDetectMs);
+    stats.Record(PipelineStats::kEstimate, frameEstimateMs);
+
+    // Hold the latency target by trading detector accuracy for speed
+    bool settingsChanged = tuner.Update(frameDetectMs);
+    if(settingsChanged) {
+      detector.SetConfig(tuner.GetConfig());
+    }
+    PublishDetectorStatus(settingsChanged);
+
+    PublishStage(kProcessed, slot);
+    processedAt = slot->data.stageDone[kProcessed].time_since_epoch().count();
+    if(!pauseTagDetections) {
+      TagSnapshot &snapshot = tagSnapshots.Back();
+      snapshot.seq = ring.GetLatestSeq(kProcessed);
+      snapshot.captureTime = slot->data.captureTime;
+      snapshot.serverTime = slot->data.serverTime;
+      snapshot.tags = tags;   // copies into the snapshot's own storage
+      tagSnapshots.Publish();
+      if(detectionsCallback) detectionsCallback();
+    }
+    ring.Release(slot);
+  }
+}
+
+void Camera::SetTagTracking(bool enabled) {
+  tagTracking = enabled;
+}
+
+void Camera::EnableFieldPose(AprilTagFieldLayout layout, Transform3d robotToCamera) {
+  fieldSolver = std::make_unique<MultiTagSolver>(layout, intrinsics, robotToCamera);
+}
+
+// Publish [x, y, z, qw, qx, qy, qz, reprojection error, ambiguity, tag count, capture time]
+void Camera::PublishFieldPose(Frame &data) {
+  if(!telemetry || !data.fieldPose.valid) return;
+  auto &pose = data.fieldPose;
+  auto &q = pose.robot.Rotation().GetQuaternion();
+  double values[] = {
+    pose.robot.X().value(), pose.robot.Y().value(), pose.robot.Z().value(),
+    q.W(), q.X(), q.Y(), q.Z(),
+    pose.reprojectionError, pose.ambiguity, (double)pose.tagCount, (double)data.captureTime
+  };
+  fieldPosePub.Set(values, data.serverTime ? NetworkClock::ToLocalTime(data.captureTime) : data.captureTime);
+}
+
+void Camera::SetStatsTable(std::shared_ptr<nt::NetworkTable> table) {
+  statsTable = table;
+  uploadPub = table->GetDoubleArrayTopic("upload").Publish();
+  mlRequestsPub = table->GetDoubleArrayTopic("mlRequests").Publish();
+  poolPub = table->GetDoubleArrayTopic("pool").Publish();
+}
+
+void Camera::PublishStats() {
+  if(!statsTable) return;
+  auto dropped = GetDroppedFrames();
+  stats.SetDropped(PipelineStats::kGrab, ring.GetExhausted() + failedGrabs);
+  stats.SetDropped(PipelineStats::kConvert, dropped.converter);
+  stats.SetDropped(PipelineStats::kDetect, dropped.processor);
+  stats.SetDropped(PipelineStats::kMotionGate, mlHeldFrames);
+  stats.SetDropped(PipelineStats::kInference, dropped.inference);
+  stats.SetDropped(PipelineStats::kInferenceSend, mlSendFailures);
+  stats.SetDropped(PipelineStats::kInferenceReceive, mlTimeouts + mlStaleResults + mlMalformedReplies);
+  stats.SetDropped(PipelineStats::kLabel, dropped.labeller);
+  stats.SetDropped(PipelineStats::kPost, dropped.poster);
+  stats.Publish(statsTable);
+  double requests[] = {(double)mlTimeouts, (double)mlLateReplies, (double)mlStaleResults, (double)mlMalformedReplies, (double)mlSendFailures};
+  mlRequestsPub.Set(requests);
+  PoolStats pool = GetPoolStats();
+  double poolValues[] = {(double)pool.slots, (double)pool.inUse, (double)pool.highWater, (double)pool.exhausted, (double)pool.reallocations};
+  poolPub.Set(poolValues);
+  if(uploadRate.Enabled()) {
+    UploadRateController::Setting setting = uploadRate.GetSetting();
+    double values[] = {uploadRate.GetBytesPerSecond(), (double)setting.quality, (double)setting.scale};
+    uploadPub.Set(values);
+  }
+}
+
+// Called by the NT loop, only counts detections it hasn't posted before
+void Camera::MarkPublished() {
+  uint64_t seq = ring.GetLatestSeq(kProcessed);
+  if(seq == lastPublishedSeq) return;
+  lastPublishedSeq = seq;
+  std::chrono::steady_clock::time_point ready{std::chrono::steady_clock::duration{processedAt.load()}};
+  stats.Record(PipelineStats::kPublish, ready, std::chrono::steady_clock::now());
+}
+
+void Camera::SetMLInputSize(cv::Size size) {
+  mlInputSize = size;
+}
+
+void Camera::EnableRecording(std::string directory) {
+  recorder = std::make_unique<FrameRecorder>(directory, id);
+}
+
+void Camera::SetDetectLatencyTarget(double ms) {
+  tuner.SetTargetMs(ms);
+}
+
+void Camera::SetTelemetryTable(std::shared_ptr<nt::NetworkTable> table) {
+  telemetry = table;
+  detectMsPub = table->GetDoubleTopic("detectMs").Publish();
+  detectAverageMsPub = table->GetDoubleTopic("detectAvgMs").Publish();
+  quadDecimatePub = table->GetDoubleTopic("quadDecimate").Publish();
+  quadSigmaPub = table->GetDoubleTopic("quadSigma").Publish();
+  numThreadsPub = table->GetDoubleTopic("detectThreads").Publish();
+  fieldPosePub = table->GetDoubleArrayTopic("fieldPose").Publish();
+  PublishDetectorStatus(true);
+}
+
+void Camera::PublishDetectorStatus(bool settingsChanged) {
+  if(!telemetry) return;
+  detectMsPub.Set(frameDetectMs);
+  detectAverageMsPub.Set(tuner.GetAverageMs());
+  if(settingsChanged) {
+    auto level = tuner.GetLevel();
+    quadDecimatePub.Set(level.quadDecimate);
+    quadSigmaPub.Set(level.quadSigma);
+    numThreadsPub.Set(level.numThreads);
   }
 }
 
 void Camera::StopInferencing() {
-  if(mlSessions.size()) {
+  if(reactor == nullptr) return;
+  reactor->Invoke([this] {
+    if(mlSessions.empty()) return;
     mlSessionAvailable = false;
-    mlThread.join();
+    mlUploadWanted = false;
+    scheduler->Remove(id);
+    reactor->Remove(mlSessions[0].GetFd());
+    mlSessions[0].Close();
     mlSessions.clear();
-  }
+  });
 }
 
-void Camera::StartInferencing(PeripherySession session) {
+// Called on the reactor thread, replies and new frames are handled there from now on
+void Camera::StartInferencing(PeripherySession session, PeripheryReactor *periphery, InferenceScheduler *inferenceScheduler) {
+  reactor = periphery;
+  scheduler = inferenceScheduler;
   mlSessions.push_back(session);
+  mlSessions[0].SetWindow(mlWindow);
+  appliedInferenceSeq = 0;
+  mlServerTimeSeq = 0;
+  sessionMalformedReplies = 0;
+  sessionSendFailures = 0;
+  sessionLateReplies = 0;
+  // Resized or rate-controlled uploads are prepared on the encoder thread, the camera's own bytes go straight out
+  mlUploadShared = mlSessions[0].UsesSharedMemory();
+  mlResizeUploads = mlInputSize.area() && mlInputSize != captureSize;
+  mlRateControlled = uploadRate.Enabled() && !mlUploadShared;
+  mlUploads.Acquire();   // drop an upload left from the last session
+  mlUploadRequested = false;
+  reactor->Add(mlSessions[0].GetFd(), [this] {
+    CollectInference();
+    PumpInference();
+  });
   mlSessionAvailable = true;
-  mlThread = std::move(std::thread(&Camera::InferenceThread, this));
+  scheduler->Add(id, mlWindow, [this] { return SendNextInference(); }, [this] { return mlSessions[0].GetInFlight(); });
+}
+
+// Move the tracks to the new frame and tell the scheduler about it, at most one notice queued per camera
+void Camera::NotifyInference() {
+  if(!mlSessionAvailable || inferencePumpQueued.exchange(true)) return;
+  reactor->Post([this] {
+    inferencePumpQueued = false;
+    if(mlSessions.empty()) return;
+    uint64_t time = captureTime;
+    // Tracks only move to frames stamped in their own time base
+    if(captureServerTime == mlServerTime) PublishTracks(time);
+    scheduler->Ready(id);
+  });
 }
 
-void Camera::InferenceThread() {
+// Free the slots of lost requests and let the scheduler hand them out, never blocks
+void Camera::PumpInference() {
+  if(mlSessions.empty()) return;
+  mlTimeouts += mlSessions[0].ExpireInFlight();
+  scheduler->Dispatch();
+  ArmInferenceExpiry();
+}
+
+// Called by the scheduler when this camera gets a slot
+bool Camera::SendNextInference() {
+  if(EncodeNextUpload()) return SendPreparedInference();
+  // Back at full quality, an upload the encoder made meanwhile is older than the newest frame
+  if(mlUploads.Acquire()) mlUploadRequested = false;
+  PeripherySession &session = mlSessions[0];
   while(true) {
-    if(!mlSessionAvailable) {
-      return;
-    }
-    if(!mlFrameAvailable && !newDetections) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(0));
+    Ring::Slot* slot = ring.WaitNewest(mlInputStage, mlCursor, std::chrono::milliseconds(0));
+    if(slot == nullptr) return false;
+    if(HoldInference(slot->data)) {
+      // The tracker carries the last boxes onto it like any frame between replies
+      mlHeldFrames++;
+      ring.Release(slot);
       continue;
     }
-    auto detections = mlSessions[0].RunInference(mlFrame);
-    mlDetections = detections;
-    mlDetectionCount = mlDetections.size();
-    mlFrameAvailable = false;
+    // Time the frame spent waiting for a slot
+    stats.Record(PipelineStats::kInferenceQueue, slot->data.stageDone[mlInputStage], std::chrono::steady_clock::now());
+    uint32_t seq = SendInference(session, slot->data);
+    if(seq && slot->data.serverTime && !mlServerTimeSeq) mlServerTimeSeq = seq;
+    // Only a frame the server saw can stand in for the ones after it
+    if(seq && !slot->data.motion.empty()) {
+      std::lock_guard<std::mutex> lock(motionLock);
+      slot->data.motion.copyTo(motionReference);
+      motionReferenceTime = slot->data.captureTime;
+    }
+    ring.Release(slot);
+    // No shared slot free, the frame didn't fit or the send failed, nothing is in flight so the slot stays free
+    if(seq == 0) {
+      TallySession();
+      return false;
+    }
+    PeripherySession::Timing timing = session.GetLastTiming();
+    if(mlRateControlled) uploadRate.Record(timing.sendBytes, timing.sendMs);
+    stats.Record(PipelineStats::kInferenceSend, timing.sendMs);
+    ArmInferenceExpiry();
+    return true;
   }
 }
 
-void Camera::StartLabeller() {
-  while(true) {
-    if(!ValidPresent() || !frameProcessed) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(threadDelay));
+// Send the upload the encoder prepared, or ask it for one and give the slot back until it's ready
+bool Camera::SendPreparedInference() {
+  PeripherySession &session = mlSessions[0];
+  if(!mlUploads.Acquire()) {
+    RequestUpload();
+    return false;
+  }
+  mlUploadRequested = false;
+  const MLUpload &upload = mlUploads.Front();
+  stats.Record(PipelineStats::kInferenceQueue, upload.queued, std::chrono::steady_clock::now());
+  uint32_t seq = upload.jpeg.empty() ? session.SendInference(upload.pixels, upload.captureTime, upload.scale)
+    : session.SendInference(upload.jpeg.data(), upload.jpeg.size(), upload.captureTime, upload.scale);
+  if(seq == 0) {
+    TallySession();
+    return false;
+  }
+  if(upload.serverTime && !mlServerTimeSeq) mlServerTimeSeq = seq;
+  PeripherySession::Timing timing = session.GetLastTiming();
+  if(mlRateControlled) uploadRate.Record(timing.sendBytes, timing.sendMs);
+  if(!upload.motion.empty()) {
+    std::lock_guard<std::mutex> lock(motionLock);
+    upload.motion.copyTo(motionReference);
+    motionReferenceTime = upload.captureTime;
+  }
+  stats.Record(PipelineStats::kInferenceSend, timing.sendMs);
+  ArmInferenceExpiry();
+  return true;
+}
+
+bool Camera::EncodeNextUpload() {
+  return mlResizeUploads || (mlRateControlled && uploadRate.GetSetting().quality != 0);
+}
+
+// Wake the encoder for the newest frame, once per upload
+void Camera::RequestUpload() {
+  if(mlUploadRequested) return;
+  mlUploadRequested = true;
+  {
+    std::lock_guard<std::mutex> lock(mlEncodeMutex);
+    mlUploadWanted = true;
+  }
+  mlEncodeWake.notify_one();
+}
+
+void Camera::ArmInferenceExpiry() {
+  PeripherySession &session = mlSessions[0];
+  // Come back when the oldest request would time out
+  int expiry = session.GetNextExpiryMs();
+  if(expiry && !inferenceExpiryQueued) {
+    inferenceExpiryQueued = true;
+    reactor->After(std::chrono::milliseconds(expiry), [this] {
+      inferenceExpiryQueued = false;
+      PumpInference();
+    });
+  }
+}
+
+// Take every reply that's in
+void Camera::CollectInference() {
+  if(mlSessions.empty()) return;
+  PeripherySession &session = mlSessions[0];
+  PeripherySession::Result &result = inferenceResult;
+  while(session.ReceiveInference(result, 0)) {
+    stats.Record(PipelineStats::kInference, result.roundTripMs);
+    stats.Record(PipelineStats::kInferenceReceive, session.GetLastTiming().receiveMs);
+    // Replies can overtake each other, never replace newer results with older ones
+    if(result.seq < appliedInferenceSeq) {
+      mlStaleResults++;
       continue;
     }
-    for(TagDetection& tag : tagDetections) {
-      DrawAprilTagBox(labelled, &tag);
+    appliedInferenceSeq = result.seq;
+    // Boxes from before the NT clock synced can't be moved onto frames stamped after
+    bool serverTime = mlServerTimeSeq && result.seq >= mlServerTimeSeq;
+    if(serverTime != mlServerTime) {
+      tracker.Reset();
+      mlPublishedTime = 0;
+      mlServerTime = serverTime;
     }
-    DrawInferenceBox(labelled, mlDetections);
-    frameLabelled = true;
+    tracker.Update(result.detections);
+    PublishTracks(result.captureTime);
   }
+  TallySession();
 }
 
-void Camera::StartPosting() {
-  while(true) {
-    if(!ValidPresent() || !frameLabelled) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(threadDelay));
+// The session counts from its own start, the camera's totals run across restarts
+void Camera::TallySession() {
+  PeripherySession &session = mlSessions[0];
+  uint64_t malformed = session.GetMalformedReplies();
+  mlMalformedReplies += malformed - sessionMalformedReplies;
+  sessionMalformedReplies = malformed;
+  uint64_t sendFailures = session.GetSendFailures();
+  mlSendFailures += sendFailures - sessionSendFailures;
+  sessionSendFailures = sendFailures;
+  uint64_t lateReplies = session.GetStaleReplies();
+  mlLateReplies += lateReplies - sessionLateReplies;
+  sessionLateReplies = lateReplies;
+}
+
+// Hand on the tracks as of a frame. Frames published already are never revisited, a reply
+// for an older frame corrects the tracks as of the newest one instead
+void Camera::PublishTracks(uint64_t time) {
+  if(appliedInferenceSeq == 0) return;
+  time = std::max(time, mlPublishedTime);
+  tracker.Predict(time, mlTracked, mlTrackIds, mlPredicted);
+  if(mlTracked.Size() == 0 && mlPublishedEmpty && time != tracker.GetUpdateTime()) return;
+  mlPublishedTime = time;
+  mlPublishedEmpty = mlTracked.Size() == 0;
+  for(SnapshotBuffer<MLSnapshot> *snapshots : {&mlSnapshots, &labelSnapshots}) {
+    MLSnapshot &snapshot = snapshots->Back();
+    snapshot.seq = appliedInferenceSeq;
+    snapshot.captureTime = time;
+    snapshot.serverTime = mlServerTime;
+    snapshot.detections = mlTracked;   // copies into the reserved arrays
+    snapshot.trackIds = mlTrackIds;
+    snapshot.predicted = mlPredicted;
+    snapshots->Publish();
+  }
+  if(detectionsCallback) detectionsCallback();
+}
+
+// Compare thumbnails against the last frame sent rather than the previous one, so slow drift still adds up
+bool Camera::HoldInference(Frame &data) {
+  if(motionThreshold <= 0 || data.motion.empty()) return false;
+  std::lock_guard<std::mutex> lock(motionLock);
+  if(motionReference.size() != data.motion.size()) return false;
+  if(data.captureTime - motionReferenceTime >= motionMaxHoldUs) return false;
+  auto start = std::chrono::steady_clock::now();
+  double change = cv::norm(data.motion, motionReference, cv::NORM_L1) / data.motion.total();
+  stats.Record(PipelineStats::kMotionGate, start, std::chrono::steady_clock::now());
+  return change < motionThreshold;
+}
+
+// Send a frame's JPEG to the ML server as-is, resized and rate-controlled uploads come from the encoder instead
+uint32_t Camera::SendInference(PeripherySession &session, Frame &data) {
+  if(session.UsesSharedMemory() && HasColorFrame(data)) {
+    // Pixels are already decoded, the server reads them straight out of shared memory
+    return session.SendInference(data.frame, data.captureTime);
+  }
+  if(!data.jpeg.empty()) {
+    // The camera's JPEG is already what the server wants
+    return session.SendInference(data.jpeg.data(), data.jpeg.size(), data.captureTime);
+  }
+  return session.SendInference(GetColorFrame(data), data.captureTime);
+}
+
+// Decoding, resizing and encoding take tens of ms, too long for the reactor every camera shares
+void Camera::StartMLEncoder() {
+  PlaceThread("mlenc", ThreadPlacement::kBestEffort);
+  while(running) {
+    {
+      std::unique_lock<std::mutex> lock(mlEncodeMutex);
+      mlEncodeWake.wait_for(lock, frameTimeout, [this] { return mlUploadWanted.load() || !running; });
+    }
+    if(!mlUploadWanted) continue;
+    Ring::Slot* slot = ring.WaitNewest(mlInputStage, mlEncodeCursor, frameTimeout);
+    if(slot == nullptr) continue;
+    if(HoldInference(slot->data)) {
+      mlHeldFrames++;
+      ring.Release(slot);
       continue;
     }
-    source->PutFrame(labelled);
-    newFrame = false;
-    frameProcessed = true;
+    mlUploadWanted = false;
+    MLUpload &upload = mlUploads.Back();
+    PrepareUpload(slot->data, upload);
+    ring.Release(slot);
+    mlUploads.Publish();
+    NotifyInference();
+  }
+}
+
+// Resize to the server's input size, or re-encode at the upload controller's setting
+void Camera::PrepareUpload(Frame &data, MLUpload &upload) {
+  upload.captureTime = data.captureTime;
+  upload.serverTime = data.serverTime;
+  upload.queued = data.stageDone[mlInputStage];
+  data.motion.copyTo(upload.motion);
+  upload.jpeg.clear();
+  if(mlInputSize.area() && mlInputSize != captureSize) {
+    cv::resize(GetColorFrame(data), upload.pixels, mlInputSize);
+    upload.scale = {(double)captureSize.width / mlInputSize.width, (double)captureSize.height / mlInputSize.height};
+    // Shared memory takes the pixels, UDP needs them compressed
+    if(!mlUploadShared) {
+      mlEncodeParams[1] = 95;
+      cv::imencode(".jpg", upload.pixels, upload.jpeg, mlEncodeParams);
+    }
+    return;
+  }
+  UploadRateController::Setting setting = uploadRate.GetSetting();
+  if(setting.quality == 0 && !data.jpeg.empty()) {
+    upload.jpeg.assign(data.jpeg.begin(), data.jpeg.end());
+    upload.scale = {1, 1};
+    return;
+  }
+  cv::Mat image;
+  if(setting.scale == 1) {
+    image = GetColorFrame(data);
+  } else if(!HasColorFrame(data) && !data.jpeg.empty()) {
+    // libjpeg scales in the DCT, cheaper than a full decode and a resize
+    int flags = setting.scale == 2 ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_REDUCED_COLOR_4;
+    cv::Mat encoded(1, (int)data.jpeg.size(), CV_8UC1, data.jpeg.data());
+    cv::imdecode(encoded, flags, &mlResized);
+    image = mlResized;
+  } else {
+    cv::resize(GetColorFrame(data), mlResized, cv::Size(), 1.0 / setting.scale, 1.0 / setting.scale, cv::INTER_AREA);
+    image = mlResized;
+  }
+  mlEncodeParams[1] = setting.quality ? setting.quality : 95;
+  cv::imencode(".jpg", image, upload.jpeg, mlEncodeParams);
+  upload.scale = {(double)captureSize.width / image.cols, (double)captureSize.height / image.rows};
+}
+
+void Camera::SetUploadBudget(double bytesPerSecond) {
+  uploadRate.SetBudget(bytesPerSecond);
+}
+
+void Camera::SetInferenceWindow(int requests) {
+  mlWindow = std::clamp(requests, 1, PeripherySession::MaxInFlight);
+}
+
+void Camera::SetMotionGate(double threshold, std::chrono::milliseconds maxHold) {
+  motionThreshold = threshold;
+  motionMaxHoldUs = std::chrono::duration_cast<std::chrono::microseconds>(maxHold).count();
+  // The thumbnail comes off the gray image, so gated frames go to the ML server once converted
+  mlInputStage = threshold > 0 ? kConverted : kCaptured;
+}
+
+void Camera::StartLabeller() {
+  PlaceThread("label", ThreadPlacement::kBestEffort);
+  while(running) {
+    Ring::Slot* slot = ring.WaitNewest(kProcessed, labellerCursor, frameTimeout);
+    if(slot == nullptr) continue;
+    auto start = std::chrono::steady_clock::now();
+    if(source) {
+      // Nobody watching, or the last streamed frame is too recent: skip the decode, draw and encode
+      double fps = streamFps.load(std::memory_order_relaxed);
+      bool tooSoon = fps > 0 && start - lastLabelled < std::chrono::duration<double>(1 / fps);
+      if(!source->IsEnabled() || tooSoon) {
+        ring.Release(slot);
+        continue;
+      }
+      lastLabelled = start;
+    }
+
+    // Overlays go on a copy at the stream's size, decoded straight at that size when BGR isn't needed elsewhere
+    Frame &data = slot->data;
+    int scale = streamScale.load(std::memory_order_relaxed);
+    const uchar *pooled = data.labelled.data;
+    if(scale == 1) {
+      GetColorFrame(data).copyTo(data.labelled);
+    } else if(!HasColorFrame(data) && !data.jpeg.empty() && (scale == 2 || scale == 4)) {
+      cv::Mat encoded(1, (int)data.jpeg.size(), CV_8UC1, data.jpeg.data());
+      cv::imdecode(encoded, scale == 2 ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_REDUCED_COLOR_4, &data.labelled);
+    } else {
+      cv::resize(GetColorFrame(data), data.labelled, cv::Size(captureSize.width / scale, captureSize.height / scale), 0, 0, cv::INTER_AREA);
+    }
+    TrackReallocation(data.labelled, pooled);
+    double drawScale = (double)data.labelled.cols / captureSize.width;
+    for(TagDetection& tag : data.tags) {
+      DrawAprilTagBox(data.labelled, &tag, drawScale);
+    }
+    labelSnapshots.Acquire();
+    DrawInferenceBox(data.labelled, labelSnapshots.Front().detections, drawScale);
+    stats.Record(PipelineStats::kLabel, start, std::chrono::steady_clock::now());
+    PublishStage(kLabelled, slot);
+    if(frameCallback) frameCallback(slot->data);
+    ring.Release(slot);
+  }
+}
+
+void Camera::StartPosting() {
+  PlaceThread("post", ThreadPlacement::kBestEffort);
+  while(running) {
+    Ring::Slot* slot = ring.WaitNewest(kLabelled, posterCursor, frameTimeout);
+    if(slot == nullptr) continue;
+    auto start = std::chrono::steady_clock::now();
+    source->PutFrame(slot->data.labelled);
+    stats.Record(PipelineStats::kPost, start, std::chrono::steady_clock::now());
+    ring.Release(slot);
   }
 }
 
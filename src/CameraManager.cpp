@@ -0,0 +1,184 @@
+#include "CameraManager.h"
+#include "ThreadPlacement.h"
+
+#include <algorithm>
+#include <vector>
+
+CameraManager::CameraManager(cs::VideoMode config, AprilTagPoseEstimator::Config estConfig, Camera::CaptureMode mode)
+  : config{config}, estConfig{estConfig}, mode{mode} {}
+
+CameraManager::~CameraManager() {
+  StopMonitor();
+}
+
+void CameraManager::SetSetup(std::function<void(Camera&)> setupCamera) {
+  setup = setupCamera;
+}
+
+std::string CameraManager::GetKey(const cs::UsbCameraInfo &info) {
+  for(const char *prefix : {"/dev/v4l/by-path/", "/dev/v4l/by-id/"}) {
+    for(const std::string &path : info.otherPaths) {
+      if(path.rfind(prefix, 0) == 0) return path;
+    }
+  }
+  return info.path;
+}
+
+bool CameraManager::Known(const std::string &key) {
+  for(int i = 0; i < Size(); i++) {
+    if(entries[i]->key == key) return true;
+  }
+  return false;
+}
+
+std::unique_ptr<CameraManager::Entry> CameraManager::Open(const cs::UsbCameraInfo &info, uint8_t id) {
+  auto start = std::chrono::steady_clock::now();
+  auto entry = std::make_unique<Entry>();
+  entry->key = GetKey(info);
+  // Opened by its stable link, so cscore finds it again if it re-enumerates under another node
+  entry->usb = std::make_unique<cs::UsbCamera>("camera-" + std::to_string(id), entry->key);
+  auto connected = std::chrono::steady_clock::now();
+  entry->camera = std::make_unique<Camera>(entry->usb.get(), id, config, estConfig, mode);
+  auto configured = std::chrono::steady_clock::now();
+  if(setup) setup(*entry->camera);
+  auto started = std::chrono::steady_clock::now();
+
+  auto ms = [](auto from, auto to) { return std::chrono::duration<double, std::milli>(to - from).count(); };
+  fmt::print("Camera {} ({}, {}): opened in {:.0f} ms (device {:.0f}, configure {:.0f}, start {:.0f})\n",
+    (int)entry->camera->GetID(), info.name, entry->key, ms(start, started), ms(start, connected), ms(connected, configured), ms(configured, started));
+  return entry;
+}
+
+bool CameraManager::Add(std::unique_ptr<Entry> entry) {
+  std::lock_guard<std::mutex> lock(addLock);
+  int index = count.load(std::memory_order_relaxed);
+  if(index >= MaxCameras) {
+    fmt::print("No room for camera {}, already running {}\n", entry->key, MaxCameras);
+    return false;
+  }
+  entries[index] = std::move(entry);
+  count.store(index + 1, std::memory_order_release);
+  return true;
+}
+
+void CameraManager::LogFirstFrame(Entry &entry, std::chrono::steady_clock::time_point opened) {
+  auto deadline = opened + std::chrono::seconds(5);
+  while(entry.camera->GetStageSeq(Camera::kCaptured) == 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - opened).count();
+  if(entry.camera->GetStageSeq(Camera::kCaptured)) {
+    fmt::print("Camera {}: first frame {:.0f} ms after opening\n", (int)entry.camera->GetID(), ms);
+  } else {
+    fmt::print("Camera {}: no frame within {:.0f} ms of opening\n", (int)entry.camera->GetID(), ms);
+  }
+}
+
+int CameraManager::OpenAll() {
+  CS_Status status = 0;
+  std::vector<cs::UsbCameraInfo> found = cs::EnumerateUsbCameras(&status);
+  auto start = std::chrono::steady_clock::now();
+  // IDs follow USB port order, so the same wiring gives the same IDs however the opens race
+  std::sort(found.begin(), found.end(), [](const cs::UsbCameraInfo &a, const cs::UsbCameraInfo &b) { return GetKey(a) < GetKey(b); });
+
+  // Each camera's open and mode switch blocks on its own device, so do them side by side
+  std::vector<std::thread> openers;
+  for(const cs::UsbCameraInfo &info : found) {
+    if(Known(GetKey(info))) continue;
+    uint8_t id = nextId++;
+    openers.emplace_back([this, info, id] {
+      auto opened = std::chrono::steady_clock::now();
+      std::unique_ptr<Entry> entry = Open(info, id);
+      Entry &added = *entry;
+      if(Add(std::move(entry))) LogFirstFrame(added, opened);
+    });
+  }
+  for(std::thread &opener : openers) opener.join();
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  fmt::print("{} cameras up in {:.0f} ms\n", Size(), ms);
+  return Size();
+}
+
+void CameraManager::StartMonitor(std::chrono::milliseconds interval) {
+  std::lock_guard<std::mutex> lock(monitorLock);
+  if(monitorRunning) return;
+  monitorRunning = true;
+  monitor = std::thread(&CameraManager::Monitor, this, interval);
+}
+
+void CameraManager::StopMonitor() {
+  {
+    std::lock_guard<std::mutex> lock(monitorLock);
+    monitorRunning = false;
+  }
+  monitorWake.notify_all();
+  if(monitor.joinable()) monitor.join();
+}
+
+// Runs on its own thread, so opening a camera never holds up the others' pipelines
+void CameraManager::Monitor(std::chrono::milliseconds interval) {
+  ThreadPlacement::Apply("cam-monitor", ThreadPlacement::kBestEffort);
+  std::unique_lock<std::mutex> lock(monitorLock);
+  while(monitorRunning) {
+    monitorWake.wait_for(lock, interval, [this] { return !monitorRunning; });
+    if(!monitorRunning) break;
+    lock.unlock();
+
+    CS_Status status = 0;
+    std::vector<cs::UsbCameraInfo> found = cs::EnumerateUsbCameras(&status);
+    auto now = std::chrono::steady_clock::now();
+
+    // Follow cameras dropping off and coming back
+    for(int i = 0; i < Size(); i++) {
+      Entry &entry = *entries[i];
+      bool connected = entry.usb->IsConnected();
+      if(connected == entry.connected) continue;
+      entry.connected = connected;
+      int id = entry.camera->GetID();
+      if(!connected) {
+        entry.lostAt = now;
+        fmt::print("Camera {} ({}) disconnected\n", id, entry.key);
+      } else {
+        double seconds = std::chrono::duration<double>(now - entry.lostAt).count();
+        fmt::print("Camera {} ({}) reconnected after {:.1f} s\n", id, entry.key, seconds);
+      }
+    }
+
+    // A dropped camera that's enumerated again gets reopened right away instead of on cscore's retry
+    for(const cs::UsbCameraInfo &info : found) {
+      std::string key = GetKey(info);
+      for(int i = 0; i < Size(); i++) {
+        Entry &entry = *entries[i];
+        if(entry.key == key && !entry.connected) entry.usb->SetPath(key);
+      }
+    }
+
+    // Attach cameras plugged in since the last look
+    for(const cs::UsbCameraInfo &info : found) {
+      if(Known(GetKey(info))) continue;
+      auto opened = std::chrono::steady_clock::now();
+      std::unique_ptr<Entry> entry = Open(info, nextId++);
+      Entry &added = *entry;
+      if(Add(std::move(entry))) LogFirstFrame(added, opened);
+    }
+
+    lock.lock();
+  }
+}
+
+int CameraManager::Size() {
+  return count.load(std::memory_order_acquire);
+}
+
+Camera& CameraManager::operator[](int index) {
+  return *entries[index]->camera;
+}
+
+CameraManager::Iterator CameraManager::begin() {
+  return {this, 0};
+}
+
+CameraManager::Iterator CameraManager::end() {
+  return {this, Size()};
+}
@@ -0,0 +1,142 @@
+#include "DetectionTracker.h"
+
+#include <algorithm>
+
+double DetectionTracker::IoU(double ax, double ay, double aw, double ah, double bx, double by, double bw, double bh) {
+  double overlapX = std::min(ax + aw, bx + bw) - std::max(ax, bx);
+  double overlapY = std::min(ay + ah, by + bh) - std::max(ay, by);
+  if(overlapX <= 0 || overlapY <= 0) return 0;
+  double overlap = overlapX * overlapY;
+  return overlap / (aw * ah + bw * bh - overlap);
+}
+
+double DetectionTracker::Seconds(uint64_t from, uint64_t to) {
+  return to > from ? (to - from) / 1e6 : 0;
+}
+
+uint64_t DetectionTracker::GetUpdateTime() {
+  return updateTime;
+}
+
+void DetectionTracker::Reset() {
+  for(Track &track : tracks) spareKps.push_back(std::move(track.kps));
+  tracks.clear();
+  updateTime = 0;
+}
+
+void DetectionTracker::Update(const PeripherySession::Detections &detections) {
+  uint64_t time = detections.captureTime;
+  updateTime = time;
+
+  // Pair every track, moved to the reply's frame, with the detections of its label it overlaps
+  candidates.clear();
+  for(int t = 0; t < (int)tracks.size(); t++) {
+    Track &track = tracks[t];
+    double dt = Seconds(track.time, time);
+    double x = track.centerX + track.velocityX * dt - track.width / 2;
+    double y = track.centerY + track.velocityY * dt - track.height / 2;
+    for(int d = 0; d < detections.Size(); d++) {
+      if(detections.labels[d] != track.label) continue;
+      double iou = IoU(x, y, track.width, track.height, detections.x[d], detections.y[d], detections.width[d], detections.height[d]);
+      if(iou >= matchIoU) candidates.push_back({iou, t, d});
+    }
+  }
+
+  // Greedy, best overlap first, each track and detection taken once
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) { return a.iou > b.iou; });
+  trackMatch.assign(tracks.size(), -1);
+  detectionMatched.assign(detections.Size(), false);
+  for(const Candidate &candidate : candidates) {
+    if(trackMatch[candidate.track] >= 0 || detectionMatched[candidate.detection]) continue;
+    trackMatch[candidate.track] = candidate.detection;
+    detectionMatched[candidate.detection] = true;
+  }
+
+  for(int t = 0; t < (int)tracks.size(); t++) {
+    Track &track = tracks[t];
+    int d = trackMatch[t];
+    if(d < 0) {
+      track.misses++;
+      continue;
+    }
+    double dt = Seconds(track.time, time);
+    double predictedX = track.centerX + track.velocityX * dt;
+    double predictedY = track.centerY + track.velocityY * dt;
+    double errorX = detections.x[d] + detections.width[d] / 2 - predictedX;
+    double errorY = detections.y[d] + detections.height[d] / 2 - predictedY;
+    track.centerX = predictedX + alpha * errorX;
+    track.centerY = predictedY + alpha * errorY;
+    if(dt > 0) {
+      track.velocityX += beta * errorX / dt;
+      track.velocityY += beta * errorY / dt;
+    }
+    track.width += alpha * (detections.width[d] - track.width);
+    track.height += alpha * (detections.height[d] - track.height);
+    track.time = time;
+    track.hits++;
+    track.misses = 0;
+    track.kps.assign(detections.kps.begin() + detections.kpsStart[d], detections.kps.begin() + detections.kpsStart[d] + detections.kpsCount[d]);
+    track.kpsCenterX = detections.x[d] + detections.width[d] / 2;
+    track.kpsCenterY = detections.y[d] + detections.height[d] / 2;
+  }
+
+  // Unconfirmed tracks go on their first miss, confirmed ones after a few
+  std::erase_if(tracks, [this, time](Track &track) {
+    if(track.misses == 0) return false;
+    if(track.hits >= confirmHits && track.misses <= maxMisses && Seconds(track.time, time) * 1e6 <= maxCoastUs) return false;
+    spareKps.push_back(std::move(track.kps));
+    return true;
+  });
+
+  // Whatever didn't match starts a track
+  for(int d = 0; d < detections.Size(); d++) {
+    if(detectionMatched[d]) continue;
+    Track track;
+    if(!spareKps.empty()) {
+      track.kps = std::move(spareKps.back());
+      spareKps.pop_back();
+    }
+    track.id = nextId++;
+    if(nextId == 0) nextId = 1;
+    track.label = detections.labels[d];
+    track.centerX = detections.x[d] + detections.width[d] / 2;
+    track.centerY = detections.y[d] + detections.height[d] / 2;
+    track.width = detections.width[d];
+    track.height = detections.height[d];
+    track.time = time;
+    track.hits = 1;
+    track.kps.assign(detections.kps.begin() + detections.kpsStart[d], detections.kps.begin() + detections.kpsStart[d] + detections.kpsCount[d]);
+    track.kpsCenterX = track.centerX;
+    track.kpsCenterY = track.centerY;
+    tracks.push_back(std::move(track));
+  }
+}
+
+// New tracks show up on the frame they were inferred on, but are only predicted onward once confirmed
+void DetectionTracker::Predict(uint64_t time, PeripherySession::Detections &out, std::vector<uint16_t> &ids, std::vector<uint8_t> &predicted) {
+  out.Clear();
+  ids.clear();
+  predicted.clear();
+  out.captureTime = time;
+  for(const Track &track : tracks) {
+    bool current = track.time == time && track.misses == 0;
+    if(!current && (track.hits < confirmHits || Seconds(track.time, time) * 1e6 > maxCoastUs)) continue;
+    double dt = Seconds(track.time, time);
+    double centerX = track.centerX + track.velocityX * dt;
+    double centerY = track.centerY + track.velocityY * dt;
+    out.labels.push_back(track.label);
+    out.x.push_back(centerX - track.width / 2);
+    out.y.push_back(centerY - track.height / 2);
+    out.width.push_back(track.width);
+    out.height.push_back(track.height);
+    out.kpsStart.push_back(out.kps.size());
+    out.kpsCount.push_back(track.kps.size());
+    // Keypoints ride along with the box, (x, y, confidence) each
+    for(size_t i = 0; i < track.kps.size(); i++) {
+      double shift = i % 3 == 0 ? centerX - track.kpsCenterX : i % 3 == 1 ? centerY - track.kpsCenterY : 0;
+      out.kps.push_back(track.kps[i] + shift);
+    }
+    ids.push_back(track.id);
+    predicted.push_back(!current);
+  }
+}
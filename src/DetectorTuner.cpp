@@ -0,0 +1,64 @@
+#include "DetectorTuner.h"
+
+#include <algorithm>
+#include <thread>
+
+DetectorTuner::DetectorTuner(double target) {
+  targetMs = target;
+  maxThreads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Step towards speed as soon as the target is missed, back towards accuracy only
+// after a long stretch of headroom so the detector doesn't oscillate
+bool DetectorTuner::Update(double detectMs) {
+  averageMs = averageMs ? averageMs + smoothing * (detectMs - averageMs) : detectMs;
+  framesSinceChange++;
+  if(framesSinceChange < settleFrames) return false;
+
+  if(averageMs > targetMs && level < LevelCount - 1) {
+    // The last step back didn't hold, wait longer before trying again
+    if(relaxed) relaxFrames = std::min(relaxFrames * 2, maxRelaxFrames);
+    level++;
+    relaxed = false;
+  } else {
+    if(relaxed && framesSinceChange > minRelaxFrames) {
+      relaxed = false;
+      relaxFrames = std::max(relaxFrames / 2, minRelaxFrames);
+    }
+    framesWithHeadroom = averageMs < targetMs * headroom ? framesWithHeadroom + 1 : 0;
+    if(level == 0 || framesWithHeadroom < relaxFrames) return false;
+    level--;
+    relaxed = true;
+  }
+  averageMs = 0;
+  framesSinceChange = 0;
+  framesWithHeadroom = 0;
+  return true;
+}
+
+AprilTagDetector::Config DetectorTuner::GetConfig() {
+  Level current = GetLevel();
+  AprilTagDetector::Config config{};
+  config.numThreads = current.numThreads;
+  config.quadDecimate = current.quadDecimate;
+  config.quadSigma = current.quadSigma;
+  return config;
+}
+
+DetectorTuner::Level DetectorTuner::GetLevel() {
+  Level current = Levels[level];
+  current.numThreads = std::min(current.numThreads, maxThreads);
+  return current;
+}
+
+double DetectorTuner::GetAverageMs() {
+  return averageMs;
+}
+
+void DetectorTuner::SetTargetMs(double ms) {
+  targetMs = ms;
+}
+
+double DetectorTuner::GetTargetMs() {
+  return targetMs;
+}
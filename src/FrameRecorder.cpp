@@ -0,0 +1,170 @@
+#include "FrameRecorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+FrameRecorder::FrameRecorder(std::string dir, uint8_t id, size_t segmentSize) {
+  directory = dir;
+  camId = id;
+  segmentBytes = segmentSize;
+  runStart = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  std::filesystem::create_directories(directory);
+  // Carry on after whatever an earlier run left, a restart mid-match mustn't overwrite it
+  char prefix[16];
+  snprintf(prefix, sizeof(prefix), "cam%d-", camId);
+  for(const auto &entry : std::filesystem::directory_iterator(directory)) {
+    std::string name = entry.path().filename().string();
+    int number = 0;
+    if(entry.path().extension() != ".mjpeg" || name.rfind(prefix, 0) != 0) continue;
+    if(sscanf(name.c_str() + strlen(prefix), "%d", &number) == 1) nextSegment = std::max(nextSegment, number + 1);
+  }
+  writer = std::thread(&FrameRecorder::WriterThread, this);
+}
+
+FrameRecorder::~FrameRecorder() {
+  running = false;
+  wake.notify_one();
+  writer.join();
+}
+
+void FrameRecorder::Record(const std::vector<uchar> &jpeg, uint64_t captureTime) {
+  uint64_t current = head.load(std::memory_order_relaxed);
+  uint64_t queued = current - tail.load(std::memory_order_acquire);
+  if(queued >= StagedCount) {
+    dropped++;
+    return;
+  }
+  Staged &entry = staged[current % StagedCount];
+  entry.captureTime = captureTime;
+  entry.metadataOnly = queued >= PayloadLimit;
+  if(!entry.metadataOnly) {
+    entry.jpeg.assign(jpeg.begin(), jpeg.end());  // capacity is kept between frames
+  }
+  head.store(current + 1, std::memory_order_release);
+  wake.notify_one();
+}
+
+FrameRecorder::Stats FrameRecorder::GetStats() {
+  return {recorded.load(), metadataOnly.load(), dropped.load(), bytes.load(), segmentNumber};
+}
+
+void FrameRecorder::WriterThread() {
+  while(running || tail.load() != head.load()) {
+    uint64_t current = tail.load(std::memory_order_relaxed);
+    if(current == head.load(std::memory_order_acquire)) {
+      std::unique_lock<std::mutex> lock(wakeMutex);
+      wake.wait_for(lock, std::chrono::milliseconds(20));
+      continue;
+    }
+    Staged &entry = staged[current % StagedCount];
+    size_t size = entry.metadataOnly ? 0 : entry.jpeg.size();
+    // A frame bigger than a whole segment can never be mapped, copying it would overrun
+    if(size > segmentBytes) {
+      dropped++;
+      tail.store(current + 1, std::memory_order_release);
+      continue;
+    }
+
+    // Roll over to a fresh segment when either file is full
+    if(!data || dataUsed + size > segmentBytes || entryCount == IndexCapacity) {
+      CloseSegment();
+      if(!OpenSegment()) {
+        dropped++;
+        tail.store(current + 1, std::memory_order_release);
+        continue;
+      }
+    }
+
+    memcpy(data + dataUsed, entry.jpeg.data(), size);
+    Recording::IndexEntry record{dataUsed, (uint32_t)size, entry.metadataOnly ? Recording::MetadataOnly : 0, entry.captureTime, camId, {}};
+    memcpy(index + sizeof(Recording::IndexHeader) + entryCount * sizeof(record), &record, sizeof(record));
+    entryCount++;
+    memcpy(index + offsetof(Recording::IndexHeader, entryCount), &entryCount, sizeof(entryCount));
+    dataUsed += size;
+    bytes += size;
+    if(entry.metadataOnly) metadataOnly++;
+    else recorded++;
+    tail.store(current + 1, std::memory_order_release);
+  }
+  CloseSegment();
+}
+
+bool FrameRecorder::OpenSegment() {
+  auto now = std::chrono::steady_clock::now();
+  if(now < retryAt) return false;
+  char name[64];
+  snprintf(name, sizeof(name), "/cam%d-%04d.mjpeg", camId, nextSegment);
+  std::string dataPath = directory + name;
+  std::string indexPath = dataPath + ".idx";
+  size_t indexBytes = sizeof(Recording::IndexHeader) + IndexCapacity * sizeof(Recording::IndexEntry);
+
+  dataUsed = 0;
+  entryCount = 0;
+  // Never reuse a name, one that turns up anyway is skipped; other failures retry the same number later
+  dataFd = open(dataPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  bool dataCreated = dataFd >= 0;
+  indexFd = dataFd < 0 ? -1 : open(indexPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  bool indexCreated = indexFd >= 0;
+  auto fail = [&](int error) {
+    CloseSegment();
+    if(dataCreated) unlink(dataPath.c_str());
+    if(indexCreated) unlink(indexPath.c_str());
+    if(error == EEXIST) {
+      nextSegment++;
+      return false;
+    }
+    retryMs = retryMs ? std::min(retryMs * 2, RetryMaxMs) : RetryMinMs;
+    retryAt = now + std::chrono::milliseconds(retryMs);
+    std::cout << "Recorder can't open " << dataPath << ": " << strerror(error) << ", retrying in " << retryMs << " ms" << std::endl;
+    return false;
+  };
+  if(dataFd < 0 || indexFd < 0) return fail(errno);
+  // Reserve the blocks up front so a full disk fails here instead of faulting mid-copy
+  int error = posix_fallocate(dataFd, 0, segmentBytes);
+  if(!error) error = posix_fallocate(indexFd, 0, indexBytes);
+  if(error) return fail(error);
+  data = (uchar*)mmap(nullptr, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, dataFd, 0);
+  index = (uchar*)mmap(nullptr, indexBytes, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+  if(data == MAP_FAILED || index == MAP_FAILED) {
+    error = errno;
+    if(data == MAP_FAILED) data = nullptr;
+    if(index == MAP_FAILED) index = nullptr;
+    return fail(error);
+  }
+  nextSegment++;
+  retryMs = 0;
+
+  Recording::IndexHeader header{};
+  memcpy(header.magic, Recording::IndexMagic, sizeof(header.magic));
+  header.version = Recording::Version;
+  header.runStart = runStart;
+  memcpy(index, &header, sizeof(header));
+  segmentNumber++;
+  std::cout << "Recording cam " << (int)camId << " to " << dataPath << std::endl;
+  return true;
+}
+
+void FrameRecorder::CloseSegment() {
+  size_t indexBytes = sizeof(Recording::IndexHeader) + IndexCapacity * sizeof(Recording::IndexEntry);
+  if(data) munmap(data, segmentBytes);
+  if(index) munmap(index, indexBytes);
+  if(dataFd >= 0) {
+    if(ftruncate(dataFd, dataUsed)) perror("recorder truncate error");
+    close(dataFd);
+  }
+  if(indexFd >= 0) {
+    if(ftruncate(indexFd, sizeof(Recording::IndexHeader) + entryCount * sizeof(Recording::IndexEntry))) perror("recorder truncate error");
+    close(indexFd);
+  }
+  data = nullptr;
+  index = nullptr;
+  dataFd = -1;
+  indexFd = -1;
+}
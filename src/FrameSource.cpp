@@ -0,0 +1,34 @@
+#include "FrameSource.h"
+
+UsbFrameSource::UsbFrameSource(cs::UsbCamera *camRef, uint8_t camId, cs::VideoMode config, bool rawCapture) {
+  cam = camRef;
+  id = camId;
+  sink = frc::CameraServer::GetVideo(*cam);
+  // The camera's MJPEG bytes untouched, for gray capture and recording
+  rawSink = cs::RawSink{"raw" + std::to_string(id)};
+  rawSink.SetSource(*cam);
+  if(rawCapture) {
+    // BGR is only decoded on demand
+    sink.SetEnabled(false);
+  }
+  cam->SetVideoMode(config);
+}
+
+uint64_t UsbFrameSource::GrabFrame(cv::Mat &frame) {
+  return sink.GrabFrame(frame);
+}
+
+uint64_t UsbFrameSource::GrabJpeg(std::vector<uchar> &jpeg) {
+  // Ask for MJPEG at native size, cscore hands over the camera's buffer as-is
+  rawFrame.pixelFormat = cs::VideoMode::PixelFormat::kMJPEG;
+  rawFrame.width = 0;
+  rawFrame.height = 0;
+  uint64_t time = rawSink.GrabFrame(rawFrame);
+  if(time == 0) return 0;
+  jpeg.assign((uchar*)rawFrame.data, (uchar*)rawFrame.data + rawFrame.size);
+  return time;
+}
+
+uint8_t UsbFrameSource::GetID() {
+  return id;
+}
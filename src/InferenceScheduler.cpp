@@ -0,0 +1,86 @@
+#include "InferenceScheduler.h"
+
+#include <algorithm>
+
+InferenceScheduler::InferenceScheduler(int capacity) : capacity{std::max(1, capacity)} {
+  for(std::atomic<double> &weight : weights) weight = 1.0;
+}
+
+void InferenceScheduler::SetCapacity(int requests) {
+  capacity = std::max(1, requests);
+  Dispatch();
+}
+
+void InferenceScheduler::Add(uint8_t key, int window, SendCallback send, InFlightCallback inFlight) {
+  Remove(key);
+  Client client;
+  client.key = key;
+  client.window = std::max(1, window);
+  client.ready = true;
+  client.send = send;
+  client.inFlight = inFlight;
+  clients.push_back(client);
+  Dispatch();
+}
+
+void InferenceScheduler::Remove(uint8_t key) {
+  std::erase_if(clients, [key](const Client &client) { return client.key == key; });
+  // Balances only mean something between the clients that were competing
+  for(Client &client : clients) client.credit = 0;
+}
+
+void InferenceScheduler::SetWeight(uint8_t key, double weight) {
+  weights[key].store(std::max(0.0, weight), std::memory_order_relaxed);
+}
+
+InferenceScheduler::Client* InferenceScheduler::Find(uint8_t key) {
+  for(Client &client : clients) {
+    if(client.key == key) return &client;
+  }
+  return nullptr;
+}
+
+void InferenceScheduler::Ready(uint8_t key) {
+  Client *client = Find(key);
+  if(client == nullptr) return;
+  client->ready = true;
+  Dispatch();
+}
+
+int InferenceScheduler::GetInFlight() {
+  int total = 0;
+  for(Client &client : clients) total += client.inFlight();
+  return total;
+}
+
+// Every eligible client gains its weight in credit per slot handed out, the one
+// furthest ahead gets the slot and pays back the total. Over a run each client
+// gets slots in proportion to its weight, interleaved rather than in bursts.
+void InferenceScheduler::Dispatch() {
+  int inFlight = GetInFlight();
+  while(inFlight < capacity) {
+    Client *best = nullptr;
+    double bestCredit = 0;
+    double total = 0;
+    for(Client &client : clients) {
+      double weight = weights[client.key].load(std::memory_order_relaxed);
+      client.eligible = client.ready && weight > 0 && client.inFlight() < client.window;
+      if(!client.eligible) continue;
+      total += weight;
+      if(best == nullptr || client.credit + weight > bestCredit) {
+        best = &client;
+        bestCredit = client.credit + weight;
+      }
+    }
+    if(best == nullptr) return;
+    if(!best->send()) {
+      best->ready = false;
+      continue;
+    }
+    for(Client &client : clients) {
+      if(client.eligible) client.credit += weights[client.key].load(std::memory_order_relaxed);
+    }
+    best->credit -= total;
+    inFlight++;
+  }
+}
@@ -0,0 +1,98 @@
+#include "MultiTagSolver.h"
+
+#include <Eigen/Core>
+
+MultiTagSolver::MultiTagSolver(AprilTagFieldLayout fieldLayout, AprilTagPoseEstimator::Config intrinsics, Transform3d robotToCamera) {
+  layout = fieldLayout;
+  cameraToRobot = robotToCamera.Inverse();
+  tagSize = units::meter_t{intrinsics.tagSize}.value();
+
+  cameraMatrix = cv::Mat::zeros(3, 3, CV_64F);
+  cameraMatrix.at<double>(0, 0) = intrinsics.fx;
+  cameraMatrix.at<double>(1, 1) = intrinsics.fy;
+  cameraMatrix.at<double>(0, 2) = intrinsics.cx;
+  cameraMatrix.at<double>(1, 2) = intrinsics.cy;
+  cameraMatrix.at<double>(2, 2) = 1;
+  distortion = cv::Mat::zeros(4, 1, CV_64F);
+}
+
+void MultiTagSolver::Reset() {
+  objectPoints.clear();
+  imagePoints.clear();
+  tagCount = 0;
+}
+
+void MultiTagSolver::AddTag(int id, const double corners[8]) {
+  auto tagPose = layout.GetTagPose(id);
+  if(!tagPose) return;  // tag isn't on this field
+
+  // Corners in the tag frame (+X out of the face) in detection order:
+  // bottom left, bottom right, top right, top left as seen by the camera
+  const double half = tagSize / 2;
+  const double offsets[4][2] = {{-half, -half}, {half, -half}, {half, half}, {-half, half}};
+  for(int i = 0; i < 4; i++) {
+    Translation3d corner{units::meter_t{0}, units::meter_t{offsets[i][0]}, units::meter_t{offsets[i][1]}};
+    Translation3d field = tagPose->Translation() + corner.RotateBy(tagPose->Rotation());
+    objectPoints.push_back({field.X().value(), field.Y().value(), field.Z().value()});
+    imagePoints.push_back({corners[i*2], corners[i*2+1]});
+  }
+  tagCount++;
+}
+
+MultiTagSolver::FieldPose MultiTagSolver::Solve() {
+  FieldPose result{};
+  result.tagCount = tagCount;
+  if(!tagCount) return result;
+
+  rvecs.clear();
+  tvecs.clear();
+  errors.clear();
+  int best = 0;
+  if(tagCount > 1) {
+    // Corners from several tags are generally not coplanar, SQPnP gives one global solution
+    int solutions = cv::solvePnPGeneric(objectPoints, imagePoints, cameraMatrix, distortion, rvecs, tvecs, false, cv::SOLVEPNP_SQPNP, cv::noArray(), cv::noArray(), errors);
+    if(!solutions) return result;
+  } else {
+    // A lone square has two plausible poses, IPPE returns both with their errors
+    int solutions = cv::solvePnPGeneric(objectPoints, imagePoints, cameraMatrix, distortion, rvecs, tvecs, false, cv::SOLVEPNP_IPPE, cv::noArray(), cv::noArray(), errors);
+    if(!solutions) return result;
+    if(solutions > 1) {
+      best = errors[1] < errors[0] ? 1 : 0;
+      int alternate = 1 - best;
+      result.ambiguity = errors[alternate] > 0 ? errors[best] / errors[alternate] : 1;
+      if(result.ambiguity > ambiguityThreshold && hasLastCamera) {
+        // Too close to call from the image alone, stay consistent with the last pose
+        Pose3d bestPose = ToFieldPose(rvecs[best], tvecs[best]);
+        Pose3d alternatePose = ToFieldPose(rvecs[alternate], tvecs[alternate]);
+        double bestJump = (bestPose.Translation() - lastCamera.Translation()).Norm().value();
+        double alternateJump = (alternatePose.Translation() - lastCamera.Translation()).Norm().value();
+        if(alternateJump < bestJump) best = alternate;
+      }
+    }
+  }
+
+  result.camera = ToFieldPose(rvecs[best], tvecs[best]);
+  result.robot = result.camera.TransformBy(cameraToRobot);
+  result.reprojectionError = errors[best];
+  result.valid = true;
+  lastCamera = result.camera;
+  hasLastCamera = true;
+  return result;
+}
+
+// PnP maps field points into the OpenCV camera frame (right, down, forward).
+// Invert that and swap to WPILib axes (forward, left, up) for the camera pose.
+Pose3d MultiTagSolver::ToFieldPose(const cv::Mat &rvec, const cv::Mat &tvec) {
+  cv::Mat r;
+  cv::Rodrigues(rvec, r);
+  Eigen::Matrix3d rotation;
+  double position[3];
+  for(int i = 0; i < 3; i++) {
+    position[i] = -(r.at<double>(0, i) * tvec.at<double>(0) + r.at<double>(1, i) * tvec.at<double>(1) + r.at<double>(2, i) * tvec.at<double>(2));
+    rotation(i, 0) = r.at<double>(2, i);
+    rotation(i, 1) = -r.at<double>(0, i);
+    rotation(i, 2) = -r.at<double>(1, i);
+  }
+  Translation3d translation{units::meter_t{position[0]}, units::meter_t{position[1]}, units::meter_t{position[2]}};
+  return Pose3d{translation, Rotation3d{rotation}};
+}
@@ -0,0 +1,28 @@
+#include "NetworkClock.h"
+
+#include <atomic>
+
+static std::atomic<int64_t> serverOffset = 0;
+static std::atomic<bool> synced = false;
+
+void NetworkClock::Start(nt::NetworkTableInstance instance) {
+  instance.AddTimeSyncListener(true, [instance](const nt::Event &event) {
+    auto offset = instance.GetServerTimeOffset();
+    if(!offset) return;
+    // Whoever sees the flag converts with the offset
+    serverOffset.store(*offset, std::memory_order_relaxed);
+    synced.store(true, std::memory_order_release);
+  });
+}
+
+bool NetworkClock::Synced() {
+  return synced.load(std::memory_order_acquire);
+}
+
+int64_t NetworkClock::ToServerTime(int64_t localTime) {
+  return localTime + serverOffset.load(std::memory_order_relaxed);
+}
+
+int64_t NetworkClock::ToLocalTime(int64_t serverTime) {
+  return serverTime - serverOffset.load(std::memory_order_relaxed);
+}
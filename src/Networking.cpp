@@ -1,5 +1,9 @@
 #include "Networking.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
 // Return a page id for a configured network socket
 int Networking::GetSocket() {
     int sock = -1;
@@ -32,3 +36,49 @@ int Networking::SendReceive(int sock, struct pollfd *fd, struct sockaddr_in *ser
     }
     return 0;
 }
+
+// Send every prepared datagram with as few syscalls as possible
+int Networking::SendBatch(int sock, struct mmsghdr *messages, int count) {
+    int sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(sock, messages + sent, count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("sendmmsg error");
+            break;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+// Wait up to timeoutMs for one datagram
+int Networking::Receive(int sock, struct pollfd *fd, uchar* buf, int bufSize, int timeoutMs) {
+    int ret = poll(fd, 1, timeoutMs);
+    if (ret > 0) {
+        int count = recv(sock, buf, bufSize, 0);
+        return count > 0 ? count : 0;
+    }
+    return 0;
+}
+
+void Networking::RoundTrip::Update(double ms) {
+    if (smoothed == 0) {
+        smoothed = ms;
+        variance = ms / 2;
+    } else {
+        variance = 0.75 * variance + 0.25 * std::abs(smoothed - ms);
+        smoothed = 0.875 * smoothed + 0.125 * ms;
+    }
+    backoff = 1;
+}
+
+void Networking::RoundTrip::TimedOut() {
+    backoff = std::min(backoff * 2, MaxTimeoutMs / MinTimeoutMs);
+}
+
+int Networking::RoundTrip::GetTimeoutMs() {
+    if (smoothed == 0) return MaxTimeoutMs;  // nothing measured yet
+    int timeout = (int)(smoothed + 4 * variance + 1) * backoff;
+    return std::clamp(timeout, MinTimeoutMs, MaxTimeoutMs);
+}
@@ -4,167 +4,174 @@ using namespace Networking;
 
 PeripheryClient::PeripheryClient() {
   sock = GetSocket();
-  fd.fd = sock;
-  fd.events = POLLIN;
+  int yes = 1;
+  int ret = setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (char*)&yes, sizeof(yes));
+  if (ret == -1) {
+    perror("setsockopt error");
+  }
 }
 
-// Find IP Address and Port of Periphery server
-int PeripheryClient::GetCommandSocket() {
-    uchar request[6];
-    memcpy(&request, UdpSignature, 4);
-    memcpy(&request[4], DiscoverSignature, 2);
-    int yes = 1;
-    struct timeval timeout;
-    timeout.tv_usec = 1000000;
-    struct sockaddr_in broadcast_addr;
-    struct sockaddr_in server_addr;
-    socklen_t addr_len;
-    int count;
-    int ret;
-    fd_set readfd;
-    char buffer[100];
-    
-    ret = setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (char*)&yes, sizeof(yes));
-    if (ret == -1) {
-      perror("setsockopt error");
-      return 0;
-    }
-
-    addr_len = sizeof(struct sockaddr_in);
-
-    memset((void*)&broadcast_addr, 0, addr_len);
-    broadcast_addr.sin_family = AF_INET;
-    broadcast_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-    broadcast_addr.sin_port = htons(COMMAND_PORT);
-
-    ret = sendto(sock, request, sizeof(request), 0, (struct sockaddr*) &broadcast_addr, addr_len);
-
-    /*FD_ZERO(&readfd);*/
-    /*FD_SET(sock, &readfd);*/
-    /*ret = select(sock + 1, &readfd, NULL, NULL, &timeout);*/
-    ret = poll(&fd, 1, 1000);
-    if (!ret) return 0;
-    while(memcmp(buffer, request, sizeof(request))) {
-      /*if (FD_ISSET(sock, &readfd)) {*/
-        clientConnected = true;
-        count = recvfrom(sock, buffer, 1024, 0, (struct sockaddr*)&server_addr, &addr_len);
-        server_address.sin_family = server_addr.sin_family;
-        server_address.sin_addr = server_addr.sin_addr;
-        server_address.sin_port = server_addr.sin_port;
-      /*}*/
-    } 
-
-    std::cout << "Server address is " << inet_ntoa(server_addr.sin_addr) << ':' << htons(server_addr.sin_port) << std::endl;
-    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
-    if (ret == -1) {
-      perror("setsockopt error");
-      return 0;
-    }
-
-    return 1;
+void PeripheryClient::Attach(PeripheryReactor *periphery) {
+  reactor = periphery;
+  reactor->Add(sock, [this] { OnReadable(); });
 }
 
-std::string PeripheryClient::GetAvailableModels() {
-  // Create message header buffer
-  uchar header[sizeof(UdpSignature) + sizeof(ModelListSignature)];
-  size_t headerSize = sizeof(header);
-  memcpy(&header[0], UdpSignature, sizeof(UdpSignature));
-  memcpy(&header[sizeof(UdpSignature)], ModelListSignature, sizeof(ModelListSignature));
-  memcpy(request, header, headerSize);
-
-  int bytes = SendReceive(sock, &fd, &server_address, request, headerSize, response, sizeof(response));
-  if(!bytes) clientConnected = false;
-
-  if(!memcmp(header, response, headerSize)) {
-      
-    uchar sizeHigh = response[headerSize];
-    uchar sizeLow = response[headerSize + 1];
-    unsigned int size = (sizeHigh << 8) + sizeLow;
+std::vector<uchar> PeripheryClient::BuildRequest(const uchar *signature, const uchar *payload, size_t payloadSize) {
+  std::vector<uchar> request(sizeof(UdpSignature) + 2 + payloadSize);
+  memcpy(&request[0], UdpSignature, sizeof(UdpSignature));
+  memcpy(&request[sizeof(UdpSignature)], signature, 2);
+  if(payloadSize) memcpy(&request[sizeof(UdpSignature) + 2], payload, payloadSize);
+  return request;
+}
 
-    if(size && size < sizeof(response)) {   // Valid data is present
-      std::string models = std::string{(char*)response + headerSize + 2, size};
-      return models;
+// Find IP Address and Port of Periphery server
+void PeripheryClient::Discover(std::function<void(bool found)> done) {
+  struct sockaddr_in broadcast_addr;
+  memset((void*)&broadcast_addr, 0, sizeof(broadcast_addr));
+  broadcast_addr.sin_family = AF_INET;
+  broadcast_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+  broadcast_addr.sin_port = htons(COMMAND_PORT);
+
+  std::vector<uchar> request = BuildRequest(DiscoverSignature);
+  size_t headerSize = request.size();
+  Send({request, headerSize, broadcast_addr, 1000, [this, done](const uchar *body, int size) {
+    if(!body) {
+      done(false);
+      return;
     }
-  }
-  return "NONE";
+    clientConnected = true;
+    std::cout << "Server address is " << inet_ntoa(server_address.sin_addr) << ':' << htons(server_address.sin_port) << std::endl;
+    done(true);
+  }});
 }
 
-bool PeripheryClient::SwitchModel(std::string modelName) {
-  // Create message header buffer
-  uchar header[sizeof(UdpSignature) + sizeof(SelectModelSignature)];
-  size_t headerSize = sizeof(header);
-  memcpy(&header[0], UdpSignature, sizeof(UdpSignature));
-  memcpy(&header[sizeof(UdpSignature)], SelectModelSignature, sizeof(SelectModelSignature));
-  memcpy(request, header, headerSize);
-
-  int payloadSize = modelName.length();
-  char nameBuf[payloadSize];
-  strcpy(nameBuf, modelName.c_str());
-  memcpy(request + headerSize, nameBuf, payloadSize);
-
-  int bytes = SendReceive(sock, &fd, &server_address, request, headerSize + payloadSize, response, sizeof(response));
-  if(!bytes) clientConnected = false;
-
-  if(!memcmp(header, response, headerSize)) {
-    bool success = response[headerSize];
-    return success;
-  }
-  return false;
+void PeripheryClient::GetAvailableModels(std::function<void(std::string models)> done) {
+  std::vector<uchar> request = BuildRequest(ModelListSignature);
+  Send({request, request.size(), server_address, 500, [done](const uchar *body, int size) {
+    if(body && size >= 2) {
+      unsigned int length = (body[0] << 8) + body[1];
+      if(length && length <= size - 2) {   // Valid data is present
+        done(std::string{(const char*)body + 2, length});
+        return;
+      }
+    }
+    done("NONE");
+  }});
 }
 
+void PeripheryClient::SwitchModel(std::string modelName, std::function<void(bool success)> done) {
+  std::vector<uchar> request = BuildRequest(SelectModelSignature, (const uchar*)modelName.c_str(), modelName.length());
+  Send({request, sizeof(UdpSignature) + sizeof(SelectModelSignature), server_address, 500, [done](const uchar *body, int size) {
+    done(body && size >= 1 && body[0]);
+  }});
+}
 
-PeripherySession PeripheryClient::CreateInferenceSession() {
-  // Create message header buffer
-  uchar header[sizeof(UdpSignature) + sizeof(StartSessionSignature)];
-  size_t headerSize = sizeof(header);
-  memcpy(&header[0], UdpSignature, sizeof(UdpSignature));
-  memcpy(&header[sizeof(UdpSignature)], StartSessionSignature, sizeof(StartSessionSignature));
-  memcpy(request, header, headerSize);
-
-  int bytes = SendReceive(sock, &fd, &server_address, request, headerSize, response, sizeof(response));
-  if(!bytes) clientConnected = false;
-
-  struct sockaddr_in session_addr;
-  if(!memcmp(header, response, headerSize)) {
-    uint32_t address;
-    memcpy(&address, response + headerSize, 4);
-
-    uchar portHigh = response[headerSize+4];
-    uchar portLow = response[headerSize + 5];
-    unsigned int port = (portHigh << 8) + portLow;
-    struct sockaddr_in session_addr;
+void PeripheryClient::CreateInferenceSession(std::function<void(PeripherySession session)> done) {
+  std::vector<uchar> request = BuildRequest(StartSessionSignature);
+  Send({request, request.size(), server_address, 500, [this, done](const uchar *body, int size) {
+    struct sockaddr_in session_addr{};
+    if(!body || size < 10) {
+      done(PeripherySession{0, session_addr, false});
+      return;
+    }
+    unsigned int port = (body[4] << 8) + body[5];
     session_addr.sin_family = AF_INET;
     session_addr.sin_addr.s_addr = server_address.sin_addr.s_addr;
     session_addr.sin_port = htons(port);
     std::cout << "Session address is " << inet_ntoa(session_addr.sin_addr) << ':' << htons(session_addr.sin_port) << std::endl;
     uint32_t id;
-    memcpy(&id, response + headerSize + 6, 4);
-    return PeripherySession{id, session_addr};
-  }
-  return PeripherySession{0, session_addr, false};
-  /*return false;*/
+    memcpy(&id, body + 6, 4);
+    PeripherySession session{id, session_addr};
+    if(sharedMemory) AttachSharedMemory(session, done);
+    else done(session);
+  }});
 }
 
-bool PeripheryClient::SessionAvailable(uint32_t id) {
-  // Create message header buffer
-  uchar header[sizeof(UdpSignature) + sizeof(QuerySessionSignature)];
-  size_t headerSize = sizeof(header);
-  memcpy(&header[0], UdpSignature, sizeof(UdpSignature));
-  memcpy(&header[sizeof(UdpSignature)], QuerySessionSignature, sizeof(QuerySessionSignature));
-  memcpy(request, header, headerSize);
-
-  memcpy(request + headerSize, &id, 4);
+// The local server answers on the handshake socket, so finish from the reactor instead of waiting on it
+void PeripheryClient::AttachSharedMemory(PeripherySession session, std::function<void(PeripherySession session)> done) {
+  auto ring = std::make_shared<SharedFrameRing>();
+  int fd = ring->Connect(session.GetID(), PeripherySession::MaxInFlight, sharedSlotBytes);
+  if(fd < 0) {
+    done(session);  // no local server, stays on UDP
+    return;
+  }
+  // Whichever of the answer and the timeout comes first hands the session on
+  auto finished = std::make_shared<bool>(false);
+  auto finish = [this, ring, fd, finished, session, done](bool answered) mutable {
+    if(*finished) return;
+    *finished = true;
+    pendingHandshakes--;
+    reactor->Remove(fd);
+    if(answered && ring->FinishConnect()) session.UseSharedMemory(ring);
+    ring.reset();   // a ring nobody took closes its handshake and memory here
+    done(session);
+  };
+  pendingHandshakes++;
+  reactor->Add(fd, [finish]() mutable { finish(true); });
+  reactor->After(std::chrono::milliseconds(SharedHandshakeMs), [finish]() mutable { finish(false); });
+}
 
-  int bytes = SendReceive(sock, &fd, &server_address, request, headerSize + 4, response, sizeof(response));
-  if(!bytes) clientConnected = false;
+void PeripheryClient::SessionAvailable(uint32_t id, std::function<void(bool alive)> done) {
+  std::vector<uchar> request = BuildRequest(QuerySessionSignature, (const uchar*)&id, 4);
+  Send({request, sizeof(UdpSignature) + sizeof(QuerySessionSignature), server_address, 500, [done](const uchar *body, int size) {
+    done(body && size >= 1 && body[0]);
+  }});
+}
 
-  if(!memcmp(header, response, headerSize)) {
-    bool alive = response[headerSize];
-    return alive;
-  }
-  return false;
+void PeripheryClient::SetSharedMemory(bool enabled, size_t slotBytes) {
+  sharedMemory = enabled;
+  sharedSlotBytes = slotBytes;
 }
 
 bool PeripheryClient::GetClientConnected() {
   return clientConnected;
 }
+
+int PeripheryClient::GetPendingCommands() {
+  return commands.size() + pendingHandshakes;
+}
+
+void PeripheryClient::Send(Command command) {
+  commands.push_back(std::move(command));
+  if(!commandActive) SendNext();
+}
+
+void PeripheryClient::SendNext() {
+  if(commands.empty()) return;
+  Command &command = commands.front();
+  commandActive = true;
+  uint64_t number = ++commandNumber;
+  sendto(sock, command.request.data(), command.request.size(), 0, (struct sockaddr*)&command.address, sizeof(command.address));
+  reactor->After(std::chrono::milliseconds(command.timeoutMs), [this, number] {
+    if(commandActive && number == commandNumber) {
+      clientConnected = false;
+      Complete(nullptr, 0);
+    }
+  });
+}
+
+void PeripheryClient::Complete(const uchar *body, int size) {
+  Command command = std::move(commands.front());
+  commands.pop_front();
+  commandActive = false;
+  command.done(body, size);
+  if(!commandActive) SendNext();  // done may already have queued and sent another
+}
+
+void PeripheryClient::OnReadable() {
+  struct sockaddr_in from;
+  socklen_t addr_len = sizeof(from);
+  int count;
+  while((count = recvfrom(sock, response, sizeof(response), MSG_DONTWAIT, (struct sockaddr*)&from, &addr_len)) > 0) {
+    if(!commandActive) continue;  // late reply to a command that already timed out
+    Command &command = commands.front();
+    if(count < command.headerSize || memcmp(response, command.request.data(), command.headerSize)) continue;
+    if(command.address.sin_addr.s_addr == htonl(INADDR_BROADCAST)) {
+      server_address.sin_family = from.sin_family;
+      server_address.sin_addr = from.sin_addr;
+      server_address.sin_port = from.sin_port;
+    }
+    Complete(response + command.headerSize, count - command.headerSize);
+    addr_len = sizeof(from);
+  }
+}
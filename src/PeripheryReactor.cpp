@@ -0,0 +1,147 @@
+#include "PeripheryReactor.h"
+
+#include <future>
+#include <iostream>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+PeripheryReactor::PeripheryReactor() {
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(epollFd < 0 || wakeFd < 0) {
+    perror("reactor setup error");
+    return;
+  }
+  struct epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = wakeFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+}
+
+PeripheryReactor::~PeripheryReactor() {
+  Stop();
+  if(wakeFd >= 0) close(wakeFd);
+  if(epollFd >= 0) close(epollFd);
+}
+
+void PeripheryReactor::Start() {
+  running = true;
+  thread = std::thread(&PeripheryReactor::Run, this);
+}
+
+void PeripheryReactor::Stop() {
+  running = false;
+  Wake();
+  if(thread.joinable()) thread.join();
+}
+
+void PeripheryReactor::Add(int fd, Callback onReadable) {
+  if(running && !InReactor()) {
+    Invoke([this, fd, onReadable] { Add(fd, onReadable); });
+    return;
+  }
+  handlers[fd] = std::make_shared<Callback>(onReadable);
+  struct epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll add error");
+  }
+}
+
+void PeripheryReactor::Remove(int fd) {
+  if(running && !InReactor()) {
+    Invoke([this, fd] { Remove(fd); });
+    return;
+  }
+  handlers.erase(fd);
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void PeripheryReactor::Post(Callback task) {
+  {
+    std::lock_guard<std::mutex> lock(postedLock);
+    posted.push_back(std::move(task));
+  }
+  Wake();
+}
+
+void PeripheryReactor::Invoke(Callback task) {
+  if(!running || InReactor()) {
+    task();
+    return;
+  }
+  std::promise<void> done;
+  Post([&] {
+    task();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+void PeripheryReactor::After(std::chrono::milliseconds delay, Callback task) {
+  {
+    std::lock_guard<std::mutex> lock(postedLock);
+    postedTimers.push_back({Clock::now() + delay, 0, std::move(task)});
+  }
+  Wake();
+}
+
+bool PeripheryReactor::InReactor() {
+  return std::this_thread::get_id() == thread.get_id();
+}
+
+void PeripheryReactor::Wake() {
+  uint64_t one = 1;
+  if(write(wakeFd, &one, sizeof(one)) < 0) {
+    // Counter is already non-zero, the reactor will wake anyway
+  }
+}
+
+void PeripheryReactor::Run() {
+  struct epoll_event events[MaxEvents];
+  std::vector<Callback> tasks;
+  while(running) {
+    // Pick up work handed over from other threads
+    {
+      std::lock_guard<std::mutex> lock(postedLock);
+      tasks.swap(posted);
+      for(Timer &timer : postedTimers) {
+        timer.order = timerOrder++;
+        timers.push(std::move(timer));
+      }
+      postedTimers.clear();
+    }
+    for(Callback &task : tasks) task();
+    tasks.clear();
+
+    // Run due timers, then sleep until the next one or an event
+    auto now = Clock::now();
+    while(!timers.empty() && timers.top().due <= now) {
+      Callback task = timers.top().task;
+      timers.pop();
+      task();
+    }
+    int timeout = -1;
+    if(!timers.empty()) {
+      timeout = std::chrono::ceil<std::chrono::milliseconds>(timers.top().due - Clock::now()).count();
+      if(timeout < 0) timeout = 0;
+    }
+
+    int count = epoll_wait(epollFd, events, MaxEvents, timeout);
+    for(int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if(fd == wakeFd) {
+        uint64_t value;
+        while(read(wakeFd, &value, sizeof(value)) > 0);
+        continue;
+      }
+      auto handler = handlers.find(fd);
+      if(handler == handlers.end()) continue;   // removed by an earlier handler
+      std::shared_ptr<Callback> callback = handler->second;
+      (*callback)();
+    }
+  }
+}
@@ -1,5 +1,7 @@
 #include "PeripherySession.h"
 
+#include <unistd.h>
+
 using namespace Networking;
 
 PeripherySession::PeripherySession(uint32_t id, struct sockaddr_in session_addr, bool correctlyConfigured) {
@@ -11,97 +13,354 @@ PeripherySession::PeripherySession(uint32_t id, struct sockaddr_in session_addr,
   fd.events = POLLIN;
 }
 
-// Turn current buffer into a Detection
-PeripherySession::Detection PeripherySession::ConstructDetection(uchar *buf) {
-    Detection det{};
-    det.label = (int)buf[2];
-    double *temp;
-    temp = (double*)(buf+3);
-    det.x = *temp;
-    temp++;
-    det.y = *temp;
-    temp++;
-    det.width = *temp;
-    temp++;
-    det.height = *temp;
-    temp++;
-
-    uchar* kpsTemp = (uchar*)temp;
-    uchar kpsLenHigh = *kpsTemp;
-    kpsTemp++;
-    uchar kpsLenLow = *kpsTemp;
-    unsigned int kpsLen = (kpsLenHigh << 8) + kpsLenLow;
-    kpsTemp++;
-    temp = (double*)kpsTemp;
+void PeripherySession::Detections::Clear() {
+    labels.clear();
+    x.clear();
+    y.clear();
+    width.clear();
+    height.clear();
+    kpsStart.clear();
+    kpsCount.clear();
+    kps.clear();
+}
 
-    for(int i = 0; i < kpsLen; i += 8) {
-      det.kps.push_back(*temp);
-      temp++;
+void PeripherySession::Detections::Scale(double scaleX, double scaleY) {
+    if(scaleX == 1 && scaleY == 1) return;
+    for(int i = 0; i < Size(); i++) {
+        x[i] *= scaleX;
+        y[i] *= scaleY;
+        width[i] *= scaleX;
+        height[i] *= scaleY;
+        // Keypoints are (x, y, confidence) within each detection, a short run mustn't shift the next one's
+        double *points = kps.data() + kpsStart[i];
+        for(uint32_t k = 0; k + 1 < kpsCount[i]; k += 3) {
+            points[k] *= scaleX;
+            points[k + 1] *= scaleY;
+        }
     }
+}
 
-    return det;
+void PeripherySession::Detections::Reserve(int detections, int keypoints) {
+    labels.reserve(detections);
+    x.reserve(detections);
+    y.reserve(detections);
+    width.reserve(detections);
+    height.reserve(detections);
+    kpsStart.reserve(detections);
+    kpsCount.reserve(detections);
+    kps.reserve(keypoints);
 }
 
 uint32_t PeripherySession::GetID() {
   return sessionId;
 }
 
-// Request inferencing on a frame
-std::vector<PeripherySession::Detection> PeripherySession::RunInference(cv::Mat frame) {
-    // Create message header buffer
-    size_t headerSize = sizeof(UdpSignature) + sizeof(InferenceSignature) + 4;
-    uchar header[headerSize];
+int PeripherySession::GetFd() {
+  return shared ? shared->GetResultFd() : sock;
+}
+
+void PeripherySession::Close() {
+  shared.reset();
+  if(sock >= 0) close(sock);
+  sock = -1;
+  fd.fd = -1;
+}
+
+PeripherySession::Timing PeripherySession::GetLastTiming() {
+  return lastTiming;
+}
+
+void PeripherySession::UseSharedMemory(std::shared_ptr<SharedFrameRing> ring) {
+  shared = ring;
+  std::cout << "Session " << sessionId << " using shared memory" << std::endl;
+}
+
+bool PeripherySession::UsesSharedMemory() {
+  return shared != nullptr;
+}
+
+// Send a frame for inference; raw pixels over shared memory, otherwise JPEG encoded first
+uint32_t PeripherySession::SendInference(cv::Mat frame, uint64_t captureTime, cv::Size2d scale) {
+    if(shared) {
+        SharedFrames::Format format = frame.channels() == 1 ? SharedFrames::kGray : SharedFrames::kBGR;
+        return SendShared(format, frame, nullptr, 0, captureTime, scale);
+    }
+    cv::imencode(".jpg", frame, encoded);
+    return SendInference(encoded.data(), encoded.size(), captureTime, scale);
+}
+
+// Send an already compressed frame for inference as-is, returns its sequence number or 0 when the window is full
+uint32_t PeripherySession::SendInference(const uchar *jpeg, size_t jpegSize, uint64_t captureTime, cv::Size2d scale) {
+    if(shared) return SendShared(SharedFrames::kJpeg, cv::Mat(), jpeg, jpegSize, captureTime, scale);
+    if(GetInFlight() >= window) return 0;
+    uint32_t seq = ++lastSeq;
+
+    // Header: signatures, session, then the frame's sequence number and capture time the server echoes back
+    uchar header[HeaderSize];
     memcpy(&header[0], UdpSignature, sizeof(UdpSignature));
     memcpy(&header[sizeof(UdpSignature)], InferenceSignature, sizeof(InferenceSignature));
     memcpy(&header[sizeof(UdpSignature) + sizeof(InferenceSignature)], &sessionId, 4);
-    memcpy(request, header, headerSize);
-    /*std::cout << "Session ID: " << (int)sessionId << std::endl;*/
+    memcpy(&header[SeqOffset], &seq, 4);
+    memcpy(&header[SeqOffset + 4], &captureTime, 8);
 
     // Chunk our frame into manageable pieces 
     const int MaxChunk = MaxDatagram - sizeof(header) - 1;  // extra config byte after header
-    std::vector<uchar> frameVec;
-    cv::imencode(".jpg", frame, frameVec);
     // CHUNK CHUNK CHUNK CHUNK
-    const int vectorSize = frameVec.size();
-    uchar* rawVector = frameVec.data();
+    const int vectorSize = jpegSize;
+    const uchar* rawVector = jpeg;
     int totalChunks = ceil((double)vectorSize / (double)MaxChunk);
-    int result = 0;
+    if(messages.size() < totalChunks) {
+        chunkPrefixes.resize(totalChunks * (sizeof(header) + 1));
+        chunkVectors.resize(totalChunks * 2);
+        messages.resize(totalChunks);
+    }
+    // Each datagram is the header and last-chunk byte followed by its slice of the JPEG, sent in place
     for(int i = 0; i < totalChunks; i++) {
         int offset = (i * MaxChunk);
         bool lastChunk = offset + MaxChunk >= vectorSize;
         int size = lastChunk ? vectorSize - offset : MaxChunk;
-        memcpy(request + sizeof(header) + 1, rawVector + offset, size);
-        request[sizeof(header)] = lastChunk;
-        result = SendReceive(sock, &fd, &session_address, request, sizeof(header) + 1 + size, response, sizeof(response));
-    }
-
-    if(result && !memcmp(header, response, sizeof(header))) {
-
-        uchar sizeHigh = response[sizeof(header)];
-        uchar sizeLow = response[sizeof(header) + 1];
-        unsigned int size = (sizeHigh << 8) + sizeLow;
-        if(size && size < sizeof(response)) {   // Valid data is present
-            uchar detectionsHigh = response[sizeof(header)+2];
-            uchar detectionsLow = response[sizeof(header) + 3];
-            unsigned int totalDetections = (detectionsHigh << 8) + detectionsLow;
-            /*std::cout << "Detections: " << totalDetections << std::endl;*/
-            if(totalDetections) {
-
-
-              uchar *start = response + sizeof(header) + 4;
-              std::vector<Detection> detections;
-              for(int i = 0; i < totalDetections; i++) {
-                auto current = ConstructDetection(start);
-                detections.push_back(current);
-
-                uchar lenHigh = start[0];
-                uchar lenLow = start[1];
-                unsigned int len = (lenHigh << 8) + lenLow;
-                start += len;
-              }
-              return detections;
+        uchar *prefix = &chunkPrefixes[i * (sizeof(header) + 1)];
+        memcpy(prefix, header, sizeof(header));
+        prefix[sizeof(header)] = lastChunk;
+        chunkVectors[i * 2] = {prefix, sizeof(header) + 1};
+        chunkVectors[i * 2 + 1] = {(void*)(rawVector + offset), (size_t)size};
+        messages[i] = {};
+        messages[i].msg_hdr.msg_name = &session_address;
+        messages[i].msg_hdr.msg_namelen = sizeof(session_address);
+        messages[i].msg_hdr.msg_iov = &chunkVectors[i * 2];
+        messages[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    // Send the whole frame at once, the kernel has its own copy once this returns
+    auto start = std::chrono::steady_clock::now();
+    int chunksSent = SendBatch(sock, messages.data(), totalChunks);
+    auto sent = std::chrono::steady_clock::now();
+    // The server never answers a frame missing chunks, don't hold a window slot waiting on it
+    if(chunksSent < totalChunks) {
+        sendFailures++;
+        return 0;
+    }
+    TrackPending(seq, captureTime, scale, jpegSize, start, sent);
+    return seq;
+}
+
+// Write a frame into a free shared slot, either pixels from frame or bytes from data
+uint32_t PeripherySession::SendShared(SharedFrames::Format format, const cv::Mat &frame, const uchar *data, size_t size, uint64_t captureTime, cv::Size2d scale) {
+    if(GetInFlight() >= window) return 0;
+    size_t frameBytes = format == SharedFrames::kJpeg ? size : frame.total() * frame.elemSize();
+    if(frameBytes > shared->GetSlotBytes()) return 0;
+
+    // Slots of expired requests stay with the server until it answers them
+    int index = -1;
+    for(int i = 0; i < shared->GetSlotCount() && index < 0; i++) {
+        if(shared->GetSlot(i)->state.load(std::memory_order_acquire) == SharedFrames::kFree) index = i;
+    }
+    if(index < 0) return 0;
+
+    auto start = std::chrono::steady_clock::now();
+    uint32_t seq = ++lastSeq;
+    SharedFrames::SlotHeader *slot = shared->GetSlot(index);
+    uchar *destination = shared->GetFrame(index);
+    slot->seq = seq;
+    slot->captureTime = captureTime;
+    slot->format = format;
+    slot->frameBytes = frameBytes;
+    slot->resultBytes = 0;
+    if(format == SharedFrames::kJpeg) {
+        slot->width = 0;
+        slot->height = 0;
+        slot->stride = 0;
+        memcpy(destination, data, size);
+    } else {
+        // Rows are packed in the slot whatever the source stride
+        size_t rowBytes = frame.cols * frame.elemSize();
+        slot->width = frame.cols;
+        slot->height = frame.rows;
+        slot->stride = rowBytes;
+        for(int row = 0; row < frame.rows; row++) {
+            memcpy(destination + row * rowBytes, frame.ptr(row), rowBytes);
+        }
+    }
+    slot->state.store(SharedFrames::kRequest, std::memory_order_release);
+    shared->SignalRequest();
+    TrackPending(seq, captureTime, scale, frameBytes, start, std::chrono::steady_clock::now());
+    return seq;
+}
+
+void PeripherySession::TrackPending(uint32_t seq, uint64_t captureTime, cv::Size2d scale, size_t bytes, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point sent) {
+    lastTiming.sendMs = std::chrono::duration<double, std::milli>(sent - start).count();
+    lastTiming.sendBytes = bytes;
+    for(Pending &pending : inFlight) {
+        if(pending.seq) continue;
+        pending = {seq, captureTime, scale, start, sent};
+        break;
+    }
+}
+
+// Match a reply to its request, null when it's stale
+PeripherySession::Pending* PeripherySession::FindPending(uint32_t seq) {
+    for(Pending &candidate : inFlight) {
+        if(candidate.seq && candidate.seq == seq) return &candidate;
+    }
+    staleReplies++;
+    return nullptr;
+}
+
+// Fill a result from its request and reply body
+void PeripherySession::CompleteResult(Pending &pending, const uchar *body, int size, Result &result) {
+    auto received = std::chrono::steady_clock::now();
+    lastTiming.receiveMs = std::chrono::duration<double, std::milli>(received - pending.sent).count();
+    lastTiming.timedOut = false;
+    roundTrip.Update(std::chrono::duration<double, std::milli>(received - pending.started).count());
+
+    result.seq = pending.seq;
+    result.captureTime = pending.captureTime;
+    result.roundTripMs = std::chrono::duration<double, std::milli>(received - pending.started).count();
+    result.detections.captureTime = pending.captureTime;
+    cv::Size2d scale = pending.scale;
+    pending = {};
+    if(!ParseDetections(body, size, result.detections)) {
+        malformedReplies++;
+        result.detections.Clear();
+    }
+    result.detections.Scale(scale.width, scale.height);
+}
+
+// Take one answered shared slot, waiting up to timeoutMs for the server's signal
+bool PeripherySession::ReceiveShared(Result &result, int timeoutMs) {
+    struct pollfd signal{shared->GetResultFd(), POLLIN, 0};
+    for(int attempt = 0; attempt < 2; attempt++) {
+        SharedFrameRing::ClearSignal(signal.fd);
+        for(int i = 0; i < shared->GetSlotCount(); i++) {
+            SharedFrames::SlotHeader *slot = shared->GetSlot(i);
+            if(slot->state.load(std::memory_order_acquire) != SharedFrames::kResult) continue;
+            Pending *pending = FindPending(slot->seq);
+            if(pending != nullptr) {
+                int size = std::min<size_t>(slot->resultBytes, SharedFrames::ResultBytes);
+                CompleteResult(*pending, shared->GetResult(i), size, result);
             }
+            slot->state.store(SharedFrames::kFree, std::memory_order_release);
+            if(pending != nullptr) return true;
         }
+        if(attempt || poll(&signal, 1, timeoutMs) <= 0) break;
+    }
+    return false;
+}
+
+// Wait up to timeoutMs for a reply to any request in flight
+bool PeripherySession::ReceiveInference(Result &result, int timeoutMs) {
+    if(shared) return ReceiveShared(result, timeoutMs);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(true) {
+        int remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        int count = Receive(sock, &fd, response, sizeof(response), std::max(remaining, 0));
+        if(!count) return false;
+        // Skip anything that isn't an inference reply for this session
+        if(count < HeaderSize) continue;
+        if(memcmp(response, UdpSignature, sizeof(UdpSignature))) continue;
+        if(memcmp(response + sizeof(UdpSignature), InferenceSignature, sizeof(InferenceSignature))) continue;
+        if(memcmp(response + sizeof(UdpSignature) + sizeof(InferenceSignature), &sessionId, 4)) continue;
+
+        // Match the echoed sequence number, replies for expired or unknown requests are stale
+        uint32_t seq;
+        memcpy(&seq, &response[SeqOffset], 4);
+        Pending *pending = FindPending(seq);
+        if(pending == nullptr) continue;
+        CompleteResult(*pending, response + HeaderSize, count - HeaderSize, result);
+        return true;
+    }
+}
+
+// Give up on requests older than the reply timeout, returns how many expired
+int PeripherySession::ExpireInFlight() {
+    int timeoutMs = roundTrip.GetTimeoutMs();
+    lastTiming.timeoutMs = timeoutMs;
+    auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(timeoutMs);
+    int expired = 0;
+    for(Pending &pending : inFlight) {
+        if(!pending.seq || pending.sent > cutoff) continue;
+        pending = {};
+        expired++;
+    }
+    if(expired) {
+        lastTiming.timedOut = true;
+        roundTrip.TimedOut();
+    }
+    return expired;
+}
+
+// Time until the oldest request in flight expires (ms), 0 when nothing is in flight
+int PeripherySession::GetNextExpiryMs() {
+    auto now = std::chrono::steady_clock::now();
+    auto timeout = std::chrono::milliseconds(roundTrip.GetTimeoutMs());
+    int next = 0;
+    for(Pending &pending : inFlight) {
+        if(!pending.seq) continue;
+        int remaining = std::chrono::ceil<std::chrono::milliseconds>(pending.sent + timeout - now).count();
+        remaining = std::max(remaining, 1);
+        if(!next || remaining < next) next = remaining;
+    }
+    return next;
+}
+
+int PeripherySession::GetInFlight() {
+    int count = 0;
+    for(Pending &pending : inFlight) count += pending.seq != 0;
+    return count;
+}
+
+void PeripherySession::SetWindow(int requests) {
+    window = std::clamp(requests, 1, MaxInFlight);
+}
+
+uint64_t PeripherySession::GetStaleReplies() {
+    return staleReplies;
+}
+
+uint64_t PeripherySession::GetMalformedReplies() {
+    return malformedReplies;
+}
+
+uint64_t PeripherySession::GetSendFailures() {
+    return sendFailures;
+}
+
+// Big-endian 16 bit length at the given position
+static unsigned int ReadLength(const uchar *at) {
+    return (at[0] << 8) + at[1];
+}
+
+// Unpack the detections of a reply body (everything after the echoed header).
+// Doubles are copied out rather than dereferenced in place since records aren't aligned.
+bool PeripherySession::ParseDetections(const uchar *body, int size, Detections &detections) {
+    detections.Clear();
+    if(size < 4) return false;
+    if(!ReadLength(body)) return true;   // no valid data present
+    unsigned int totalDetections = ReadLength(body + 2);
+
+    // Each record is its length (2), label (1), box (4 doubles), keypoint bytes (2), then the keypoints
+    const int RecordHeader = 3 + 4 * sizeof(double) + 2;
+    int offset = 4;
+    for(unsigned int i = 0; i < totalDetections; i++) {
+        const uchar *record = body + offset;
+        if(size - offset < RecordHeader) return false;
+        unsigned int length = ReadLength(record);
+        unsigned int kpsBytes = ReadLength(record + RecordHeader - 2);
+        if(length < RecordHeader + kpsBytes || length > size - offset || kpsBytes % sizeof(double)) return false;
+
+        double box[4];
+        memcpy(box, record + 3, sizeof(box));
+        detections.labels.push_back(record[2]);
+        detections.x.push_back(box[0]);
+        detections.y.push_back(box[1]);
+        detections.width.push_back(box[2]);
+        detections.height.push_back(box[3]);
+        size_t kpsStart = detections.kps.size();
+        detections.kpsStart.push_back(kpsStart);
+        detections.kpsCount.push_back(kpsBytes / sizeof(double));
+        detections.kps.resize(kpsStart + kpsBytes / sizeof(double));
+        memcpy(detections.kps.data() + kpsStart, record + RecordHeader, kpsBytes);
+        offset += length;
     }
-    return {};
+    return true;
 }
@@ -0,0 +1,61 @@
+#include "PipelineStats.h"
+
+void PipelineStats::Record(Stage stage, double ms) {
+  stages[stage].histogram.Record(ms > 0 ? (uint64_t)(ms * 1000) : 0);
+}
+
+void PipelineStats::Record(Stage stage, Clock::time_point start, Clock::time_point end) {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  stages[stage].histogram.Record(elapsed > 0 ? elapsed : 0);
+}
+
+void PipelineStats::SetDropped(Stage stage, uint64_t total) {
+  stages[stage].dropped.store(total, std::memory_order_relaxed);
+}
+
+void PipelineStats::Publish(std::shared_ptr<nt::NetworkTable> table) {
+  auto now = Clock::now();
+  bool first = lastPublish == Clock::time_point{};
+  double seconds = std::chrono::duration<double>(now - lastPublish).count();
+  lastPublish = now;
+  for(int i = 0; i < kStageCount; i++) {
+    StageStats &stage = stages[i];
+    if(first) {
+      stage.publisher = table->GetDoubleArrayTopic(GetName((Stage)i)).Publish();
+      stage.histogram.Snapshot(stage.previous);
+      stage.previousDropped = stage.dropped;
+      continue;
+    }
+    stage.histogram.Snapshot(stage.current);
+    uint64_t dropped = stage.dropped;
+    double values[] = {
+      LatencyHistogram::Total(stage.current, stage.previous) / seconds,
+      LatencyHistogram::Percentile(stage.current, stage.previous, 0.5) / 1000.0,
+      LatencyHistogram::Percentile(stage.current, stage.previous, 0.95) / 1000.0,
+      LatencyHistogram::Percentile(stage.current, stage.previous, 0.99) / 1000.0,
+      LatencyHistogram::Percentile(stage.current, stage.previous, 1.0) / 1000.0,
+      (dropped - stage.previousDropped) / seconds
+    };
+    stage.publisher.Set(values);
+    stage.previous = stage.current;
+    stage.previousDropped = dropped;
+  }
+}
+
+const char* PipelineStats::GetName(Stage stage) {
+  switch(stage) {
+    case kGrab: return "grab";
+    case kConvert: return "convert";
+    case kDetect: return "detect";
+    case kEstimate: return "estimate";
+    case kMotionGate: return "motionGate";
+    case kInference: return "inference";
+    case kInferenceQueue: return "inferenceQueue";
+    case kInferenceSend: return "inferenceSend";
+    case kInferenceReceive: return "inferenceReceive";
+    case kLabel: return "label";
+    case kPost: return "post";
+    case kPublish: return "publish";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,234 @@
+#include "ReplayFrameSource.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include "FrameRecorder.h"
+
+namespace fs = std::filesystem;
+
+// Offset just past the EOI of the JPEG starting at start, 0 if it's truncated
+static size_t FindJpegEnd(const std::vector<uchar> &data, size_t start) {
+  size_t pos = start + 2;
+  while(pos + 4 <= data.size()) {
+    if(data[pos] != 0xFF) return 0;
+    uchar marker = data[pos+1];
+    if(marker == 0xFF) {  // fill byte
+      pos++;
+      continue;
+    }
+    if(marker == 0xD9) return pos + 2;
+    size_t length = (data[pos+2] << 8) | data[pos+3];
+    pos += 2 + length;
+    if(marker != 0xDA) continue;
+    // Scan data runs until a marker that isn't byte stuffing or a restart
+    while(pos + 1 < data.size()) {
+      uchar following = data[pos+1];
+      if(data[pos] == 0xFF && following != 0x00 && (following < 0xD0 || following > 0xD7)) break;
+      pos++;
+    }
+  }
+  return 0;
+}
+
+static std::vector<uchar> ReadFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<uchar>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+ReplayFrameSource::ReplayFrameSource(std::string path, bool realTimePlayback, double fps, int cam, int run) {
+  realTime = realTimePlayback;
+  uint64_t intervalUs = 1000000 / fps;
+  if(LoadRecordings(path, cam, run)) {
+    // Recorder segments carry their own timestamps
+  } else if(fs::is_directory(path)) {
+    LoadDirectory(path);
+    LoadTimestamps((fs::path(path) / "timestamps.txt").string(), intervalUs);
+  } else {
+    LoadMjpeg(path);
+    LoadTimestamps(path + ".timestamps", intervalUs);
+  }
+  // Pace on the gap to the previous frame, a stamp that goes backwards plays immediately
+  for(size_t i = 1; i < frames.size(); i++) {
+    uint64_t gap = frames[i].time > frames[i-1].time ? frames[i].time - frames[i-1].time : 0;
+    frames[i].offset = frames[i-1].offset + gap;
+  }
+}
+
+void ReplayFrameSource::LoadDirectory(const std::string &path) {
+  std::vector<fs::path> images;
+  for(const auto &entry : fs::directory_iterator(path)) {
+    std::string ext = entry.path().extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if(ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp") {
+      images.push_back(entry.path());
+    }
+  }
+  std::sort(images.begin(), images.end());
+  for(const fs::path &image : images) {
+    RecordedFrame frame{ReadFile(image.string())};
+    if(frame.jpeg.size() < 2 || frame.jpeg[0] != 0xFF || frame.jpeg[1] != 0xD8) {
+      // Not a JPEG, re-encode once so the luma-only capture modes can use it too
+      cv::Mat decoded = cv::imread(image.string(), cv::IMREAD_COLOR);
+      if(decoded.empty()) continue;
+      cv::imencode(".jpg", decoded, frame.jpeg, {cv::IMWRITE_JPEG_QUALITY, 95});
+    }
+    frames.push_back(std::move(frame));
+  }
+}
+
+void ReplayFrameSource::LoadMjpeg(const std::string &path) {
+  std::vector<uchar> data = ReadFile(path);
+  size_t pos = 0;
+  while(pos + 4 <= data.size()) {
+    if(data[pos] != 0xFF || data[pos+1] != 0xD8) {  // seek to the next SOI
+      pos++;
+      continue;
+    }
+    size_t end = FindJpegEnd(data, pos);
+    if(!end) break;
+    frames.push_back({std::vector<uchar>(data.begin() + pos, data.begin() + end)});
+    pos = end;
+  }
+}
+
+bool ReplayFrameSource::LoadRecordings(const std::string &path, int cam, int run) {
+  struct Segment {
+    fs::path path;
+    int cam = 0;
+    int number = 0;
+    uint64_t runStart = 0;
+  };
+  std::vector<fs::path> candidates;
+  if(fs::is_directory(path)) {
+    for(const auto &entry : fs::directory_iterator(path)) {
+      if(entry.path().extension() == ".mjpeg" && fs::exists(entry.path().string() + ".idx")) {
+        candidates.push_back(entry.path());
+      }
+    }
+  } else if(fs::exists(path + ".idx")) {
+    candidates.push_back(path);
+  }
+  if(candidates.empty()) return false;
+
+  std::vector<Segment> segments;
+  for(const fs::path &candidate : candidates) {
+    Segment segment{candidate};
+    bool named = sscanf(candidate.filename().string().c_str(), "cam%d-%d", &segment.cam, &segment.number) == 2;
+    if(!named && candidates.size() > 1) continue;
+    Recording::IndexHeader header{};
+    std::ifstream index(candidate.string() + ".idx", std::ios::binary);
+    index.read((char*)&header, sizeof(header));
+    if(index.gcount() < (std::streamsize)Recording::V1HeaderSize) continue;
+    segment.runStart = header.version == 1 ? 0 : header.runStart;
+    segments.push_back(segment);
+  }
+  if(segments.empty()) return true;
+
+  // Several cameras and runs share one directory, only one camera's run plays as a stream
+  if(fs::is_directory(path)) {
+    if(cam < 0) {
+      cam = std::min_element(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) { return a.cam < b.cam; })->cam;
+    }
+    std::erase_if(segments, [cam](const Segment &segment) { return segment.cam != cam; });
+    std::vector<uint64_t> runs;
+    for(const Segment &segment : segments) runs.push_back(segment.runStart);
+    std::sort(runs.begin(), runs.end());
+    runs.erase(std::unique(runs.begin(), runs.end()), runs.end());
+    int chosen = run < 0 ? run + (int)runs.size() : run;   // negative counts back from the latest
+    if(chosen < 0 || chosen >= (int)runs.size()) {
+      std::cout << "Recording has " << runs.size() << " runs of cam " << cam << ", no run " << run << std::endl;
+      return true;
+    }
+    uint64_t runStart = runs[chosen];
+    std::erase_if(segments, [runStart](const Segment &segment) { return segment.runStart != runStart; });
+    std::cout << "Replaying cam " << cam << " run " << chosen << " of " << runs.size() << std::endl;
+  }
+  std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) { return a.number < b.number; });
+  camId = segments[0].cam;
+
+  for(const Segment &segment : segments) {
+    std::vector<uchar> data = ReadFile(segment.path.string());
+    std::vector<uchar> index = ReadFile(segment.path.string() + ".idx");
+    Recording::IndexHeader header;
+    if(index.size() < Recording::V1HeaderSize) continue;
+    memcpy(&header, index.data(), Recording::V1HeaderSize);
+    size_t headerSize = header.version == 1 ? Recording::V1HeaderSize : sizeof(header);
+    if(memcmp(header.magic, Recording::IndexMagic, sizeof(header.magic)) || index.size() < headerSize) continue;
+    if(header.version != 1 && header.version != Recording::Version) continue;
+    // Entry count may run past the file if the recorder died before trimming it
+    size_t count = std::min<size_t>(header.entryCount, (index.size() - headerSize) / sizeof(Recording::IndexEntry));
+    for(size_t i = 0; i < count; i++) {
+      Recording::IndexEntry entry;
+      memcpy(&entry, index.data() + headerSize + i * sizeof(entry), sizeof(entry));
+      if((entry.flags & Recording::MetadataOnly) || !entry.size || entry.offset + entry.size > data.size()) continue;
+      frames.push_back({std::vector<uchar>(data.begin() + entry.offset, data.begin() + entry.offset + entry.size), entry.captureTime ? entry.captureTime : 1});
+    }
+  }
+  return true;
+}
+
+void ReplayFrameSource::LoadTimestamps(const std::string &path, uint64_t intervalUs) {
+  std::ifstream file(path);
+  uint64_t time = 0;
+  for(RecordedFrame &frame : frames) {
+    uint64_t recorded = 0;
+    time = file >> recorded ? recorded : time + intervalUs;
+    frame.time = time ? time : 1;   // 0 means a failed grab
+  }
+}
+
+ReplayFrameSource::RecordedFrame* ReplayFrameSource::NextFrame() {
+  size_t index = next++;
+  if(index >= frames.size()) return nullptr;
+  RecordedFrame *frame = &frames[index];
+  if(realTime) {
+    if(index == 0) started = std::chrono::steady_clock::now();
+    std::this_thread::sleep_until(started + std::chrono::microseconds(frame->offset));
+  }
+  return frame;
+}
+
+uint64_t ReplayFrameSource::GrabFrame(cv::Mat &frame) {
+  RecordedFrame *recorded = NextFrame();
+  if(recorded == nullptr) return 0;
+  cv::imdecode(cv::Mat(1, (int)recorded->jpeg.size(), CV_8UC1, recorded->jpeg.data()), cv::IMREAD_COLOR, &frame);
+  return recorded->time;
+}
+
+uint64_t ReplayFrameSource::GrabJpeg(std::vector<uchar> &jpeg) {
+  RecordedFrame *recorded = NextFrame();
+  if(recorded == nullptr) return 0;
+  jpeg.assign(recorded->jpeg.begin(), recorded->jpeg.end());
+  return recorded->time;
+}
+
+uint8_t ReplayFrameSource::GetID() {
+  return camId;
+}
+
+bool ReplayFrameSource::Paced() {
+  return realTime;
+}
+
+bool ReplayFrameSource::Exhausted() {
+  return next >= frames.size();
+}
+
+size_t ReplayFrameSource::GetFrameCount() {
+  return frames.size();
+}
+
+cv::Size ReplayFrameSource::GetFrameSize() {
+  if(frames.empty()) return {};
+  cv::Mat first = cv::imdecode(cv::Mat(1, (int)frames[0].jpeg.size(), CV_8UC1, frames[0].jpeg.data()), cv::IMREAD_COLOR);
+  return first.size();
+}
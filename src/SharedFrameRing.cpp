@@ -0,0 +1,186 @@
+#include "SharedFrameRing.h"
+
+#include <cstring>
+#include <new>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace SharedFrames;
+
+static size_t AlignPage(size_t bytes) {
+  return (bytes + 4095) & ~(size_t)4095;
+}
+
+SharedFrameRing::~SharedFrameRing() {
+  Release();
+}
+
+size_t SharedFrameRing::SlotOffset(int index) {
+  size_t slotStride = AlignPage(sizeof(SlotHeader) + ResultBytes + slotBytes);
+  return AlignPage(sizeof(RingHeader)) + index * slotStride;
+}
+
+int SharedFrameRing::Connect(uint32_t sessionId, int slots, size_t frameBytes) {
+  slotCount = slots;
+  slotBytes = frameBytes;
+
+  // Only worth setting up if a server on this machine is listening
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path + 1, SocketName, sizeof(SocketName) - 1);  // abstract namespace
+  socklen_t addressSize = offsetof(struct sockaddr_un, sun_path) + sizeof(SocketName);
+  if(sock < 0 || connect(sock, (struct sockaddr*)&address, addressSize) < 0) {
+    if(sock >= 0) close(sock);
+    return -1;
+  }
+  handshakeFd = sock;
+
+  // Pages are only backed once written, so a generous slot size costs nothing up front
+  memoryFd = memfd_create("ledvision-frames", MFD_CLOEXEC);
+  requestFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  resultFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  mappedBytes = SlotOffset(slotCount);
+  if(memoryFd < 0 || requestFd < 0 || resultFd < 0 || ftruncate(memoryFd, mappedBytes) < 0) {
+    perror("shared frame ring error");
+    Release();
+    return -1;
+  }
+  base = (uchar*)mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+  if(base == MAP_FAILED) {
+    perror("shared frame ring mmap error");
+    base = nullptr;
+    Release();
+    return -1;
+  }
+  RingHeader header{};
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  header.slotCount = slotCount;
+  header.slotBytes = slotBytes;
+  memcpy(base, &header, sizeof(header));
+  for(int i = 0; i < slotCount; i++) {
+    new (GetSlot(i)) SlotHeader{};
+  }
+
+  // Hand the memory and both eventfds over, the answer comes back on the same socket
+  Handshake handshake{};
+  memcpy(handshake.magic, Magic, sizeof(Magic));
+  handshake.sessionId = sessionId;
+  handshake.slotCount = slotCount;
+  handshake.slotBytes = slotBytes;
+  struct iovec payload{&handshake, sizeof(handshake)};
+  int fds[3] = {memoryFd, requestFd, resultFd};
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+  if(sendmsg(sock, &message, 0) != sizeof(handshake)) {
+    Release();
+    return -1;
+  }
+  return sock;
+}
+
+bool SharedFrameRing::FinishConnect() {
+  uchar accepted = 0;
+  bool ok = handshakeFd >= 0 && recv(handshakeFd, &accepted, 1, 0) == 1 && accepted;
+  CloseHandshake();
+  if(!ok) Release();
+  return ok;
+}
+
+void SharedFrameRing::CloseHandshake() {
+  if(handshakeFd >= 0) close(handshakeFd);
+  handshakeFd = -1;
+}
+
+bool SharedFrameRing::Adopt(const Handshake &handshake, int memory, int request, int result) {
+  memoryFd = memory;
+  requestFd = request;
+  resultFd = result;
+  slotCount = handshake.slotCount;
+  slotBytes = handshake.slotBytes;
+  mappedBytes = SlotOffset(slotCount);
+  if(memcmp(handshake.magic, Magic, sizeof(Magic)) || !Map()) {
+    Release();
+    return false;
+  }
+  return true;
+}
+
+bool SharedFrameRing::Map() {
+  base = (uchar*)mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+  if(base == MAP_FAILED) {
+    base = nullptr;
+    return false;
+  }
+  RingHeader header;
+  memcpy(&header, base, sizeof(header));
+  return !memcmp(header.magic, Magic, sizeof(Magic)) && header.version == Version
+    && header.slotCount == slotCount && header.slotBytes == slotBytes;
+}
+
+void SharedFrameRing::Release() {
+  CloseHandshake();
+  if(base) munmap(base, mappedBytes);
+  for(int *fd : {&memoryFd, &requestFd, &resultFd}) {
+    if(*fd >= 0) close(*fd);
+    *fd = -1;
+  }
+  base = nullptr;
+}
+
+SlotHeader* SharedFrameRing::GetSlot(int index) {
+  return (SlotHeader*)(base + SlotOffset(index));
+}
+
+uchar* SharedFrameRing::GetResult(int index) {
+  return base + SlotOffset(index) + sizeof(SlotHeader);
+}
+
+uchar* SharedFrameRing::GetFrame(int index) {
+  return base + SlotOffset(index) + sizeof(SlotHeader) + ResultBytes;
+}
+
+void SharedFrameRing::SignalRequest() {
+  uint64_t one = 1;
+  if(write(requestFd, &one, sizeof(one)) < 0) perror("shared frame signal error");
+}
+
+void SharedFrameRing::SignalResult() {
+  uint64_t one = 1;
+  if(write(resultFd, &one, sizeof(one)) < 0) perror("shared frame signal error");
+}
+
+void SharedFrameRing::ClearSignal(int fd) {
+  uint64_t value;
+  while(read(fd, &value, sizeof(value)) > 0);
+}
+
+int SharedFrameRing::GetSlotCount() {
+  return slotCount;
+}
+
+size_t SharedFrameRing::GetSlotBytes() {
+  return slotBytes;
+}
+
+int SharedFrameRing::GetRequestFd() {
+  return requestFd;
+}
+
+int SharedFrameRing::GetResultFd() {
+  return resultFd;
+}
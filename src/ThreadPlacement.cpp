@@ -0,0 +1,164 @@
+#include "ThreadPlacement.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <networktables/DoubleArrayTopic.h>
+
+// A thread that placed itself
+struct PlacedThread {
+  std::string name;
+  pid_t tid = 0;
+  ThreadPlacement::Role role = ThreadPlacement::kBestEffort;
+  std::string cores;
+  std::string scheduling;
+
+  // Usage reporting, publisher side only
+  uint64_t lastTicks = 0;
+  std::chrono::steady_clock::time_point lastRead{};
+  nt::DoubleArrayPublisher publisher;
+};
+
+static ThreadPlacement::Policy policy;
+static bool configured = false;
+static std::mutex placedLock;
+static std::vector<PlacedThread> placed;
+
+ThreadPlacement::Policy ThreadPlacement::DefaultPolicy() {
+  Policy defaults;
+  int cores = std::thread::hardware_concurrency();
+  if(cores < 2) return defaults;
+  defaults.reactorCores = {0};
+  // Two cores can't keep the encoders off the reactor's, let them float
+  int bestEffort = cores < 3 ? 0 : std::max(1, cores / 4);
+  for(int core = 1; core <= bestEffort; core++) defaults.bestEffortCores.push_back(core);
+  for(int core = bestEffort + 1; core < cores; core++) defaults.latencyCores.push_back(core);
+  return defaults;
+}
+
+void ThreadPlacement::Configure(Policy newPolicy) {
+  policy = newPolicy;
+  configured = true;
+}
+
+// Cores and niceness of a role
+static const std::vector<int> &GetCores(ThreadPlacement::Role role) {
+  if(role == ThreadPlacement::kLatency) return policy.latencyCores;
+  if(role == ThreadPlacement::kReactor) return policy.reactorCores;
+  return policy.bestEffortCores;
+}
+
+static int GetNice(ThreadPlacement::Role role) {
+  if(role == ThreadPlacement::kLatency) return policy.latencyNice;
+  if(role == ThreadPlacement::kReactor) return policy.reactorNice;
+  return policy.bestEffortNice;
+}
+
+static const char *GetRoleName(ThreadPlacement::Role role) {
+  if(role == ThreadPlacement::kLatency) return "latency";
+  if(role == ThreadPlacement::kReactor) return "reactor";
+  return "best effort";
+}
+
+// Comma separated list of cores, "any" when unpinned
+static std::string FormatCores(const std::vector<int> &cores) {
+  if(cores.empty()) return "any";
+  std::ostringstream out;
+  for(size_t i = 0; i < cores.size(); i++) out << (i ? "," : "") << cores[i];
+  return out.str();
+}
+
+void ThreadPlacement::Apply(const std::string &name, Role role) {
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  pid_t tid = syscall(SYS_gettid);
+  std::lock_guard<std::mutex> lock(placedLock);
+  std::erase_if(placed, [&](const PlacedThread &thread) { return thread.name == name; });
+  if(!configured) {
+    placed.push_back({name, tid, role, "any", "default"});
+    return;
+  }
+
+  const std::vector<int> &cores = GetCores(role);
+  std::string pinned = FormatCores(cores);
+  if(!cores.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int core : cores) CPU_SET(core, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) pinned = "any (pinning failed)";
+  }
+
+  // SCHED_FIFO needs CAP_SYS_NICE and raising priority needs it too, fall back a step at a time
+  std::string scheduling = "default";
+  sched_param param{};
+  param.sched_priority = policy.realtimePriority;
+  if(role == kLatency && policy.realtimePriority > 0 && !pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+    scheduling = "fifo " + std::to_string(policy.realtimePriority);
+  } else {
+    int nice = GetNice(role);
+    if(!setpriority(PRIO_PROCESS, tid, nice)) scheduling = "nice " + std::to_string(nice);
+  }
+
+  placed.push_back({name, tid, role, pinned, scheduling});
+}
+
+void ThreadPlacement::PrintLayout() {
+  std::lock_guard<std::mutex> lock(placedLock);
+  std::cout << "Thread layout:" << std::endl;
+  for(const PlacedThread &thread : placed) {
+    std::cout << "  " << thread.name << " (" << thread.tid << "): "
+              << GetRoleName(thread.role) << ", cores " << thread.cores
+              << ", " << thread.scheduling << std::endl;
+  }
+}
+
+// Read a thread's user plus system ticks and the core it last ran on, false once it's gone
+static bool ReadThreadStat(pid_t tid, uint64_t &ticks, int &core) {
+  std::ifstream file("/proc/self/task/" + std::to_string(tid) + "/stat");
+  std::string stat;
+  if(!std::getline(file, stat)) return false;
+  // The name field can hold spaces, fields are counted from the ')' closing it
+  size_t end = stat.rfind(')');
+  if(end == std::string::npos) return false;
+  std::istringstream fields(stat.substr(end + 2));
+  std::string field;
+  uint64_t utime = 0, stime = 0;
+  for(int i = 3; fields >> field; i++) {
+    if(i == 14) utime = std::stoull(field);
+    else if(i == 15) stime = std::stoull(field);
+    else if(i == 39) {
+      core = std::stoi(field);
+      break;
+    }
+  }
+  ticks = utime + stime;
+  return true;
+}
+
+void ThreadPlacement::PublishUsage(std::shared_ptr<nt::NetworkTable> table) {
+  static const double ticksPerSecond = sysconf(_SC_CLK_TCK);
+  std::lock_guard<std::mutex> lock(placedLock);
+  auto now = std::chrono::steady_clock::now();
+  std::erase_if(placed, [&](PlacedThread &thread) {
+    uint64_t ticks = 0;
+    int core = -1;
+    if(!ReadThreadStat(thread.tid, ticks, core)) return true;
+    if(thread.lastRead != std::chrono::steady_clock::time_point{}) {
+      if(!thread.publisher) thread.publisher = table->GetDoubleArrayTopic(thread.name).Publish();
+      double seconds = std::chrono::duration<double>(now - thread.lastRead).count();
+      double values[] = {(ticks - thread.lastTicks) / ticksPerSecond / seconds * 100, (double)core};
+      thread.publisher.Set(values);
+    }
+    thread.lastTicks = ticks;
+    thread.lastRead = now;
+    return false;
+  });
+}
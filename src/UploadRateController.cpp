@@ -0,0 +1,53 @@
+#include "UploadRateController.h"
+
+void UploadRateController::SetBudget(double bytesPerSecond) {
+  budget = bytesPerSecond;
+  level = 0;
+}
+
+bool UploadRateController::Enabled() {
+  return budget > 0;
+}
+
+UploadRateController::Setting UploadRateController::GetSetting() {
+  return Levels[level.load(std::memory_order_relaxed)];
+}
+
+void UploadRateController::Record(size_t bytes, double uploadMs) {
+  Clock::time_point now = Clock::now();
+  if(windowStart == Clock::time_point{}) windowStart = now;
+  windowBytes += bytes;
+  windowUploadMs += uploadMs;
+  windowUploads++;
+  if(now - windowStart < window) return;
+
+  double rate = windowBytes / std::chrono::duration<double>(now - windowStart).count();
+  double averageUploadMs = windowUploadMs / windowUploads;
+  bytesPerSecond.store(rate, std::memory_order_relaxed);
+  int current = level.load(std::memory_order_relaxed);
+  if(rate > budget || averageUploadMs > uploadTargetMs) {
+    // Back off right away, a congested link only gets worse
+    if(current + 1 < LevelCount) level.store(current + 1, std::memory_order_relaxed);
+    quietWindows = 0;
+  } else if(rate < budget * raiseHeadroom && averageUploadMs < uploadTargetMs / 2) {
+    if(++quietWindows >= raiseWindows && current > 0) {
+      level.store(current - 1, std::memory_order_relaxed);
+      quietWindows = 0;
+    }
+  } else {
+    quietWindows = 0;
+  }
+
+  windowStart = now;
+  windowBytes = 0;
+  windowUploadMs = 0;
+  windowUploads = 0;
+}
+
+int UploadRateController::GetLevel() {
+  return level.load(std::memory_order_relaxed);
+}
+
+double UploadRateController::GetBytesPerSecond() {
+  return bytesPerSecond.load(std::memory_order_relaxed);
+}
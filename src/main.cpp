@@ -1,3 +1,4 @@
+#include <atomic>
 #include <iostream>
 #include <vector>
 #include <filesystem>
@@ -5,6 +6,7 @@
 #include <thread>
 #include <networktables/NetworkTableInstance.h>
 #include <networktables/NetworkTable.h>
+#include <networktables/RawTopic.h>
 #include <apriltag/frc/apriltag/AprilTagDetector.h>
 #include <apriltag/frc/apriltag/AprilTagDetector_cv.h>
 #include <apriltag/frc/apriltag/AprilTagPoseEstimator.h>
@@ -14,7 +16,12 @@
 #include <units/length.h>
 
 #include "PeripheryClient.h"
+#include "InferenceScheduler.h"
 #include "Camera.h"
+#include "CameraManager.h"
+#include "DetectionWire.h"
+#include "NetworkClock.h"
+#include "ThreadPlacement.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -27,61 +34,69 @@ int width = 640;
 int height = 640;
 cs::VideoMode camConfig{cs::VideoMode::PixelFormat::kMJPEG, width, height, 30};
 
+// AprilTag detection time per frame the detector settings are tuned to hold (ms)
+double detectLatencyTarget = 15.0;
+
+// Hand frames to an inference server on this machine through shared memory, UDP otherwise
+bool inferenceSharedMemory = true;
+
+// ML requests each camera keeps in flight, raises inference fps past 1/RTT
+int inferenceWindow = 2;
+
+// Bytes per second each camera's ML uploads may take over UDP, JPEG quality and resolution drop to hold it
+double inferenceUploadBudget = 4e6;
+
+// ML requests the inference server takes at once across every camera
+int inferenceCapacity = 3;
+
+// Skip ML on frames that barely changed since the last one sent (mean gray levels on a thumbnail), 0 disables
+double motionGateThreshold = 1.5;
+
+// Longest the motion gate holds detections before a frame goes to the ML server anyway
+std::chrono::milliseconds motionGateMaxHold{500};
+
+// Decode only the MJPEG luma plane for tag detection, BGR is decoded on demand
+Camera::CaptureMode captureMode = Camera::CaptureMode::kGray;
+
+// Dashboard stream rate and downscale, the robot can change them under streamFps and streamScale
+double streamFps = 15.0;
+int streamScale = 2;
+
+// SCHED_FIFO priority of the grab, decode, detect and publish threads, 0 raises their nice value instead.
+// Either needs CAP_SYS_NICE to take effect (--realtime <priority>)
+int realtimePriority = 0;
+
+// Directory to record raw camera frames into, empty disables recording (--record <dir>)
+std::string recordDirectory = "";
+
 // To store IDs of current valid cameras
 std::vector<uint8_t> currentCams;
 
+// Event loop for the ML server command and session sockets
+PeripheryReactor reactor{};
 PeripheryClient periphery{};
 
-// Variables for sending AprilTag detections
-std::vector<uint8_t> targetTags;
-uint8_t targetCount = 0xff;
-uint8_t *tagBuffer = nullptr;
-uint32_t tagBufSize = 0;
+// Shares the inference server's requests between cameras, reactor thread only
+InferenceScheduler scheduler{inferenceCapacity};
 
-// Variables for sending ML detections
+// Most AprilTag detections posted per camera and frame, the field has 22 tags
+uint8_t maxTags = 22;
+
+// Most ML detections posted per camera and frame
 uint8_t maxDetections = 100;
-uint8_t *mlBuffer = nullptr;
-uint32_t mlBufSize = 0;
-uint8_t camsInferencing = 0xff;
-
-std::vector<cs::UsbCamera> rawCams; // Global raw camera references
-std::vector<Camera> cameras; // Global camera references
-
-// Struct format for AprilTag detection
-struct AprilTagFrame {
-  uint8_t tagId = 0;
-  uint8_t camId = 0;
-  uint32_t timeCaptured;
-  double tx;
-  double ty;
-  double tz;
-  double rx;
-  double ry;
-  double rz;
-};
-
-// Struct format for ML detection
-struct MLDetectionFrame {
-  uint8_t label = 0;
-  uint8_t camId = 0;
-  uint32_t timeCaptured;
-  double x;
-  double y;
-  double w;
-  double h;
-};
-
-const size_t TAG_FRAME_SIZE = sizeof(AprilTagFrame);
-const size_t ML_FRAME_SIZE = sizeof(MLDetectionFrame);
-
-// Global data to send in the AprilTag frame
-struct GlobalFrame {
-  uint8_t size[2];
-};
+
+// Bumped by every camera with new detections, wakes the NT publisher
+std::atomic<uint64_t> detectionsReady = 0;
+
+// Every camera running, opened at startup and attached as they're plugged in
+CameraManager cameras{camConfig, AprilTagPoseEstimator::Config{6.5_in, (double)640, (double)480, (double)320, (double)240}, captureMode};
 
 // Machine Learning inference variables
 int inferTarget = -1;
 
+// Field the multi-tag pose solve works against
+AprilTagFieldLayout fieldLayout = AprilTagFieldLayout::LoadField(AprilTagField::k2025ReefscapeWelded);
+
 // AprilTag detection objects
 AprilTagDetector detector{};
 AprilTagPoseEstimator estimator{{6.5_in, (double)640, (double)480, (double)320, (double)240}};  // dummy numbers
@@ -96,205 +111,248 @@ void debugTagPrint(int id, Transform3d transform) {
   std::cout << std::endl;
 }
 
-// Init and return all cameras plugged in
-void initCameras(cs::VideoMode config) {
-  CS_Status status = 0;
-  for (const auto& caminfo : cs::EnumerateUsbCameras(&status)) {
-    fmt::print("Dev {}: Path {} (Name {})\n", caminfo.dev, caminfo.path, caminfo.name);
-    fmt::print("vid {}: pid {}\n", caminfo.vendorId, caminfo.productId);
-    cs::UsbCamera cam{"camera-" + caminfo.dev, caminfo.path};
-    /*cam.SetVideoMode(config);*/
-    rawCams.push_back(cam);
-  }
+// Find the server and select the model, retried by superviseInference until it answers
+void findInferenceServer() {
+  periphery.Discover([](bool found) {
+    if(!found) return;
+    periphery.GetAvailableModels([](std::string models) {
+      std::cout << "Models: " << models << std::endl;
+      if(strstr(models.c_str(), "reefscape_v5") != NULL) {
+        std::cout << "reefscape_v5 is present!" << std::endl;
+      }
+      std::cout << "Switching to reefscape_v5..." << std::endl;
+      periphery.SwitchModel("reefscape_v5", [](bool success) {
+        std::cout << "Switching result: " << (int)success << std::endl;
+      });
+    });
+  });
 }
 
-void findInferenceServer() {
-  int result = 0;
-  while(result != 1) {
-    result = periphery.GetCommandSocket();
-    if(!result) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(200));
-      continue;
-    }
-    std::string models = periphery.GetAvailableModels();
-    std::cout << "Models: " << models << std::endl;
-    if(strstr(models.c_str(), "reefscape_v5") != NULL) {
-      std::cout << "reefscape_v5 is present!" << std::endl;
+// Keep an ML session open for every camera, runs on the reactor every 200 ms
+void superviseInference() {
+  if(!periphery.GetPendingCommands()) {   // otherwise the last round is still waiting on replies or handshakes
+    if(!periphery.GetClientConnected()) {
+      findInferenceServer();
+    } else {
+      for(Camera& cam : cameras) {
+        if(!cam.GetMLSessionAvailable()) {
+          periphery.CreateInferenceSession([&cam](PeripherySession session) {
+            if(session.valid) cam.StartInferencing(session, &reactor, &scheduler);
+            else session.Close();
+          });
+        } else {
+          uint32_t id = cam.GetMLSessionID();
+          periphery.SessionAvailable(id, [&cam, id](bool alive) {
+            if(!alive && cam.GetMLSessionID() == id) cam.StopInferencing();
+          });
+        }
+      }
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
-    std::cout << "Switching to reefscape_v5..." << std::endl;
-    std::cout << "Switching result: " << (int)periphery.SwitchModel("reefscape_v5") << std::endl;
   }
+  reactor.After(std::chrono::milliseconds(200), superviseInference);
 }
 
 int main(int argc, char** argv)
 {  
-  // Initialize cameras
- initCameras(camConfig);
-  for(cs::UsbCamera& cam : rawCams) {
-      auto info = cam.GetInfo();
-      std::cout << "Camera found: " << std::endl;
-      std::cout << info.path << ", " << info.name << std::endl;
-      cameras.push_back({&cam, camConfig, {6.5_in, (double)640, (double)480, (double)320, (double)240}});
+  for(int i = 1; i + 1 < argc; i++) {
+    if(std::string(argv[i]) == "--record") recordDirectory = argv[i + 1];
+    if(std::string(argv[i]) == "--realtime") realtimePriority = std::atoi(argv[i + 1]);
   }
 
-  // Construct camera sink/sources
-  for(Camera& cam : cameras) {
-    /*if(cam.ref == nullptr) continue;*/
-    std::cout << "Cam ID: " << cam.GetID() << std::endl;
-  }
-
-  if(!cameras.size()) {
-    std::cout << "No viable cameras found!" << std::endl;
-    return 0;
-  }
+  // Latency-critical threads get cores of their own, every thread places itself as it starts
+  ThreadPlacement::Policy placement = ThreadPlacement::DefaultPolicy();
+  placement.realtimePriority = realtimePriority;
+  ThreadPlacement::Configure(placement);
 
-  inferTarget = cameras[0].GetID();
-  
   // NT Initialization
   auto inst = nt::NetworkTableInstance::GetDefault();
   inst.SetServerTeam(6722);
   inst.StartClient4("jetson-client");
+  NetworkClock::Start(inst);
   auto table = inst.GetTable("/jetson");
-  
-  std::this_thread::sleep_for(std::chrono::milliseconds(300));
-  // Start capture on CvSources
-  // TCP ports start at 1181 
-  for(Camera& cam : cameras) {
-    cam.StartStream();    
-  }
 
-  // Handle ML server communications
-   std::thread inferenceSpawner([&]{
-    while(true) {
-      if(!periphery.GetClientConnected()) {
-        findInferenceServer();
-      }
-      for(Camera& cam : cameras) {
-        if(!cam.GetMLSessionAvailable()) {
-          cam.StartInferencing(periphery.CreateInferenceSession());
-        } else {
-          bool sessionAvailable = periphery.SessionAvailable(cam.GetMLSessionID());
-          if(!sessionAvailable) {
-            cam.StopInferencing();
-          }
-        }
-      }
-      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  // Requested tags come from the robot through a listener instead of being polled
+  nt::RawSubscriber requestedTagsSub = table->GetRawTopic("rqsted").Subscribe("raw", {});
+  inst.AddListener(requestedTagsSub, nt::EventFlags::kValueAll, [&](const nt::Event &event) {
+    std::vector<uint8_t> requested = requestedTagsSub.Get();
+    for(Camera& cam : cameras) {
+      cam.SetTargetTags(requested);
     }
   });
 
+  // Dashboard stream limits apply to every camera
+  nt::DoubleSubscriber streamFpsSub = table->GetDoubleTopic("streamFps").Subscribe(streamFps);
+  nt::DoubleSubscriber streamScaleSub = table->GetDoubleTopic("streamScale").Subscribe(streamScale);
+  auto applyStreamLimits = [&](const nt::Event &event) {
+    for(Camera& cam : cameras) {
+      cam.SetStreamLimits(streamFpsSub.Get(), (int)streamScaleSub.Get());
+    }
+  };
+  inst.AddListener(streamFpsSub, nt::EventFlags::kValueAll, applyStreamLimits);
+  inst.AddListener(streamScaleSub, nt::EventFlags::kValueAll, applyStreamLimits);
+
+  // The robot weights a camera's share of the inference server under mlWeight/cam<id>, e.g. the intake camera while collecting
+  std::string_view weightPrefixes[] = {"/jetson/mlWeight/cam"};
+  inst.AddListener(weightPrefixes, nt::EventFlags::kValueAll, [](const nt::Event &event) {
+    const nt::ValueEventData *data = event.GetValueEventData();
+    if(data == nullptr || !data->value.IsDouble()) return;
+    std::string name = nt::Topic{data->topic}.GetName();
+    int id = std::atoi(name.c_str() + name.rfind("cam") + 3);
+    if(id < 0 || id > 255) return;
+    scheduler.SetWeight(id, data->value.GetDouble());
+  });
 
-  /*std::cout << "Size of Tag Frame: " << (int)TAG_FRAME_SIZE << std::endl;*/
+  // Every camera is configured and started the same way, at startup or when plugged in later
+  cameras.SetSetup([&](Camera& cam) {
+    std::cout << "Cam ID: " << cam.GetID() << std::endl;
+    cam.SetTargetTags(requestedTagsSub.Get());
+    cam.SetStreamLimits(streamFpsSub.Get(), (int)streamScaleSub.Get());
+    cam.SetDetectLatencyTarget(detectLatencyTarget);
+    cam.SetInferenceWindow(inferenceWindow);
+    cam.SetUploadBudget(inferenceUploadBudget);
+    cam.SetMotionGate(motionGateThreshold, motionGateMaxHold);
+    cam.EnableFieldPose(fieldLayout);  // camera mounting offsets not measured yet, reports camera pose
+    cam.SetTelemetryTable(table->GetSubTable("cam" + std::to_string(cam.GetID())));
+    cam.SetStatsTable(table->GetSubTable("stats")->GetSubTable("cam" + std::to_string(cam.GetID())));
+    if(!recordDirectory.empty()) cam.EnableRecording(recordDirectory);
+    cam.SetDetectionsCallback([] {
+      detectionsReady.fetch_add(1, std::memory_order_release);
+      detectionsReady.notify_one();
+    });
+    // Start capture on CvSources
+    // TCP ports start at 1181 
+    cam.StartStream();
+  });
 
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  if(!cameras.OpenAll()) {
+    std::cout << "No viable cameras found, waiting for one to be plugged in" << std::endl;
+  } else {
+    inferTarget = cameras[0].GetID();
+  }
+  cameras.StartMonitor(std::chrono::seconds(2));
+
+  // Handle ML server communications, every camera shares one reactor thread
+  periphery.Attach(&reactor);
+  periphery.SetSharedMemory(inferenceSharedMemory, (size_t)width * height * 3);
+  reactor.Start();
+  reactor.Invoke([] { ThreadPlacement::Apply("ml-reactor", ThreadPlacement::kReactor); });
+  reactor.Post(superviseInference);
+
+  // This thread goes on to post detections
+  ThreadPlacement::Apply("nt-publish", ThreadPlacement::kLatency);
+
+  // Publish pipeline stats snapshots and per-thread CPU, the layout once every startup thread is placed
+  std::thread statsPublisher([&]{
+    ThreadPlacement::Apply("stats", ThreadPlacement::kBestEffort);
+    ThreadPlacement::PrintLayout();
     while(true) {
-    auto requestedTags = table->GetRaw("rqsted", targetTags);
-    targetTags.clear();
-    targetTags.insert(targetTags.end(), requestedTags.begin(), requestedTags.end());
-    for(Camera& cam : cameras) {
-      cam.SetTargetTags(targetTags);
-    }
-    
-    // reallocate tag buffer if size changed
-    uint8_t currentSize = targetTags.size();
-    if(targetCount != currentSize) {
-      free(tagBuffer);
-      tagBufSize = sizeof(GlobalFrame) + ((TAG_FRAME_SIZE + 2) * currentSize * cameras.size());
-      /*std::cout << "Size of buffer changed: " << (int)tagBufSize << std::endl;*/
-      tagBuffer = (uint8_t*)malloc(tagBufSize);
-    }
-    targetCount = currentSize;
-
-    // reallocate ML buffer if size changed
-    currentSize = cameras.size();
-    if(camsInferencing != currentSize) {
-      free(mlBuffer);
-      mlBufSize = sizeof(GlobalFrame) + ((ML_FRAME_SIZE + 2) * currentSize * maxDetections);
-      mlBuffer = (uint8_t*)malloc(mlBufSize);
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      for(Camera& cam : cameras) {
+        cam.PublishStats();
+      }
+      ThreadPlacement::PublishUsage(table->GetSubTable("threads"));
     }
-    camsInferencing = currentSize;
-    
-    uint32_t tagBufPos = 0;
-    GlobalFrame tagFrameGlobal;
-    tagBufPos += sizeof(GlobalFrame);
+  });
 
-    for(Camera& cam : cameras) {
-      if(!cam.GetTagDetectionCount()) continue;
-      auto tagDetections = cam.GetTagDetections();
+  // Detections are serialized into buffers sized for the most every camera can post
+  nt::RawPublisher tagBufPub = table->GetRawTopic("tagBuf").Publish("raw");
+  nt::RawPublisher mlBufPub = table->GetRawTopic("mlBuf").Publish("raw");
+  const int maxCameras = CameraManager::MaxCameras;
+  std::vector<uint8_t> tagBuffer(DetectionWire::HeaderSize + DetectionWire::TagRecordSize * maxTags * maxCameras);
+  std::vector<uint8_t> mlBuffer(DetectionWire::HeaderSize + DetectionWire::MLRecordSize * maxDetections * maxCameras);
+  std::vector<uint64_t> postedTagSeq(maxCameras, 0);
+  std::vector<uint64_t> postedMLTime(maxCameras, 0);
+  std::vector<uint32_t> postedMLSeq(maxCameras, 0);
+
+  // Post once per new frame, sleeping until some camera has one
+  uint64_t seen = 0;
+  while(true) {
+    detectionsReady.wait(seen, std::memory_order_acquire);
+    seen = detectionsReady.load(std::memory_order_acquire);
+
+    bool tagsChanged = false;
+    uint64_t tagsCaptured = 0;
+    bool tagsServerTime = true;
+    uint16_t tagCount = 0;
+    for(int c = 0; c < cameras.Size(); c++) {
+      Camera &cam = cameras[c];
+      const Camera::TagSnapshot &snapshot = cam.GetTagSnapshot();
+      tagsChanged |= snapshot.seq != postedTagSeq[c];
+      postedTagSeq[c] = snapshot.seq;
+      tagsCaptured = std::max(tagsCaptured, snapshot.captureTime);
+      if(snapshot.seq) tagsServerTime &= snapshot.serverTime;
       auto camId = cam.GetID();
-      auto capTime = cam.GetCaptureTime();
-      /*cam.PauseTagDetection();*/
-      for(Camera::TagDetection &det : *tagDetections) {
-        if(tagBufPos + TAG_FRAME_SIZE > tagBufSize) continue; // whoopsie, this would overflow, skip
-        // Data to get shoved into buffer
-        AprilTagFrame frame {
-          det.id, 
+      for(const Camera::TagDetection &det : snapshot.tags) {
+        if(tagCount >= maxTags * maxCameras) break;
+        auto &q = det.transform.Rotation().GetQuaternion();
+        DetectionWire::TagRecord record {
+          det.id,
           camId,
-          capTime,
+          snapshot.captureTime,
           det.transform.X().value(),
           det.transform.Y().value(),
           det.transform.Z().value(),
-          units::degree_t{det.transform.Rotation().X()}.value(),
-          units::degree_t{det.transform.Rotation().Y()}.value(),
-          units::degree_t{det.transform.Rotation().Z()}.value()
+          q.W(),
+          q.X(),
+          q.Y(),
+          q.Z()
         };
-
-        // copy into buffer and increment counter
-        memset(tagBuffer + tagBufPos, 0x69, 2);
-        memcpy(tagBuffer + tagBufPos + 2, &frame, TAG_FRAME_SIZE);
-        tagBufPos += 2 + TAG_FRAME_SIZE;
-
+        DetectionWire::EncodeTag(&tagBuffer[DetectionWire::HeaderSize + tagCount * DetectionWire::TagRecordSize], record);
+        tagCount++;
       }
-      /*cam.ResumeTagDetection();*/
     }
 
-    tagFrameGlobal.size[0] = tagBufPos & 0x00ff;
-    tagFrameGlobal.size[1] = (tagBufPos & 0xff00) >> 8;
-    memcpy(tagBuffer, &tagFrameGlobal, sizeof(GlobalFrame));
-
-    // Post tag buffer to NT
-    std::vector<uint8_t> tagBuf(tagBuffer, tagBuffer + tagBufPos);
-    table->PutRaw("tagBuf", tagBuf);
-
-    uint32_t mlBufPos = 0;
-    GlobalFrame mlFrameGlobal;
-    mlBufPos += sizeof(GlobalFrame);
+    if(tagsChanged) {
+      // Post tag buffer to NT
+      // Until the clock syncs the robot gets local times, flagged so it can tell
+      DetectionWire::WriteHeader(tagBuffer.data(), DetectionWire::kTags, tagsServerTime ? DetectionWire::kServerTime : 0, tagCount);
+      size_t tagBufSize = DetectionWire::HeaderSize + tagCount * DetectionWire::TagRecordSize;
+      tagBufPub.Set({tagBuffer.data(), tagBufSize}, tagsServerTime ? NetworkClock::ToLocalTime(tagsCaptured) : tagsCaptured);
+      for(Camera& cam : cameras) {
+        cam.MarkPublished();
+      }
+    }
 
-    for(Camera& cam : cameras) {
-      if(!cam.GetMLDetectionCount()) continue;
-      auto mlDetections = cam.GetMLDetections();
+    bool mlChanged = false;
+    uint64_t mlCaptured = 0;
+    bool mlServerTime = true;
+    uint16_t mlCount = 0;
+    for(int c = 0; c < cameras.Size(); c++) {
+      Camera &cam = cameras[c];
+      const Camera::MLSnapshot &snapshot = cam.GetMLSnapshot();
+      // Tracks move with every frame, and a late reply can correct them as of a frame already posted
+      mlChanged |= snapshot.captureTime != postedMLTime[c] || snapshot.seq != postedMLSeq[c];
+      postedMLTime[c] = snapshot.captureTime;
+      postedMLSeq[c] = snapshot.seq;
+      mlCaptured = std::max(mlCaptured, snapshot.captureTime);
+      if(snapshot.seq) mlServerTime &= snapshot.serverTime;
       auto camId = cam.GetID();
-      auto capTime = cam.GetCaptureTime();
-      for(PeripherySession::Detection &det : *mlDetections) {
-        if(mlBufPos + ML_FRAME_SIZE > mlBufSize) continue; // whoopsie, this would overflow, skip
-        // Data to get shoved into buffer
-        MLDetectionFrame frame {
-          det.label, 
+      const PeripherySession::Detections &detections = snapshot.detections;
+      for(int i = 0; i < detections.Size(); i++) {
+        if(mlCount >= maxDetections * maxCameras) break;
+        PeripherySession::Detection det = detections.Get(i);
+        DetectionWire::MLRecord record {
+          det.label,
           camId,
-          capTime,
-          det.x,
-          det.y,
-          det.width,
-          det.height,
+          (uint8_t)(snapshot.predicted[i] ? DetectionWire::kPredicted : 0),
+          snapshot.trackIds[i],
+          snapshot.captureTime,
+          DetectionWire::Saturate(det.x),
+          DetectionWire::Saturate(det.y),
+          DetectionWire::Saturate(det.width),
+          DetectionWire::Saturate(det.height)
         };
-
-        // copy into buffer and increment counter
-        memset(mlBuffer + mlBufPos, 0x69, 2);
-        memcpy(mlBuffer + mlBufPos + 2, &frame, ML_FRAME_SIZE);
-        mlBufPos += 2 + ML_FRAME_SIZE;
-
+        DetectionWire::EncodeML(&mlBuffer[DetectionWire::HeaderSize + mlCount * DetectionWire::MLRecordSize], record);
+        mlCount++;
       }
     }
 
-    mlFrameGlobal.size[0] = mlBufPos & 0x00ff;
-    mlFrameGlobal.size[1] = (mlBufPos & 0xff00) >> 8;
-    memcpy(mlBuffer, &mlFrameGlobal, sizeof(GlobalFrame));
-
-    // Post tag buffer to NT
-    std::vector<uint8_t> mlBuf(mlBuffer, mlBuffer + mlBufPos);
-    table->PutRaw("mlBuf", mlBuf);
-
-
-    /*std::this_thread::sleep_for(std::chrono::milliseconds(20));*/
+    if(mlChanged) {
+      // Post ML buffer to NT
+      DetectionWire::WriteHeader(mlBuffer.data(), DetectionWire::kML, mlServerTime ? DetectionWire::kServerTime : 0, mlCount);
+      size_t mlBufSize = DetectionWire::HeaderSize + mlCount * DetectionWire::MLRecordSize;
+      mlBufPub.Set({mlBuffer.data(), mlBufSize}, mlServerTime ? NetworkClock::ToLocalTime(mlCaptured) : mlCaptured);
+    }
   }
 }
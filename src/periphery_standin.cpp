@@ -0,0 +1,273 @@
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#include "Networking.h"
+#include "PeripheryReactor.h"
+#include "SharedFrameRing.h"
+
+// Local stand-in for the Periphery inference server. Answers the command
+// protocol and inference sessions over both UDP and the shared-memory ring,
+// returning one box per frame, so transports can be tested and benchmarked
+// without the real server or a model.
+//
+//   frc_ledvision_periphery_standin [--decode] [--delay ms]
+
+using namespace Networking;
+
+const int CommandPort = 5800;
+
+// Echoed inference header: signatures, session id, sequence number, capture time
+const size_t InferenceHeaderSize = sizeof(UdpSignature) + sizeof(InferenceSignature) + 4 + 4 + 8;
+
+// Work done per frame
+bool decodeFrames = false;
+int inferenceDelayMs = 0;
+
+PeripheryReactor reactor{};
+int commandSock = -1;
+uint32_t nextSessionId = 1;
+uint64_t framesAnswered = 0;
+
+// A session's socket and the frames being reassembled on it
+struct Session {
+  uint32_t id = 0;
+  int sock = -1;
+  uint16_t port = 0;
+  std::map<uint32_t, std::vector<uchar>> partial;   // by sequence number
+  std::unique_ptr<SharedFrameRing> shared;
+};
+std::map<uint32_t, std::unique_ptr<Session>> sessions;
+
+// Reply body: byte count, detection count, then one detection covering the middle of the frame
+std::vector<uchar> BuildReply(int width, int height) {
+  std::vector<uchar> body(4 + 37);
+  uint16_t recordSize = 37;
+  body[0] = (body.size() >> 8) & 0xff;
+  body[1] = body.size() & 0xff;
+  body[2] = 0;
+  body[3] = 1;
+  uchar *record = &body[4];
+  record[0] = recordSize >> 8;
+  record[1] = recordSize & 0xff;
+  record[2] = 0;  // label
+  double box[4] = {width / 4.0, height / 4.0, width / 2.0, height / 2.0};
+  memcpy(record + 3, box, sizeof(box));
+  record[35] = 0;  // no keypoints
+  record[36] = 0;
+  return body;
+}
+
+// Stand-in for running the model, returns the frame size it saw
+cv::Size Infer(const uchar *data, size_t size, uint32_t format, int width, int height) {
+  if(format != SharedFrames::kJpeg) return {width, height};
+  if(!decodeFrames) return {0, 0};
+  cv::Mat decoded = cv::imdecode(cv::Mat(1, (int)size, CV_8UC1, (void*)data), cv::IMREAD_COLOR);
+  return decoded.size();
+}
+
+// Send a reply now or after the configured model time
+void Later(std::function<void()> reply) {
+  framesAnswered++;
+  if(inferenceDelayMs) reactor.After(std::chrono::milliseconds(inferenceDelayMs), reply);
+  else reply();
+}
+
+void OnSessionDatagram(Session *session) {
+  uchar buffer[65536];
+  struct sockaddr_in from;
+  socklen_t fromSize = sizeof(from);
+  int count;
+  while((count = recvfrom(session->sock, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&from, &fromSize)) > 0) {
+    fromSize = sizeof(from);
+    if(count < InferenceHeaderSize + 1) continue;
+    uint32_t seq;
+    memcpy(&seq, buffer + InferenceHeaderSize - 12, 4);
+    std::vector<uchar> &frame = session->partial[seq];
+    frame.insert(frame.end(), buffer + InferenceHeaderSize + 1, buffer + count);
+    if(!buffer[InferenceHeaderSize]) continue;  // more chunks to come
+
+    cv::Size size = Infer(frame.data(), frame.size(), SharedFrames::kJpeg, 0, 0);
+    session->partial.erase(seq);
+    std::vector<uchar> reply(buffer, buffer + InferenceHeaderSize);
+    std::vector<uchar> body = BuildReply(size.width, size.height);
+    reply.insert(reply.end(), body.begin(), body.end());
+    int sock = session->sock;
+    Later([sock, reply, from] {
+      sendto(sock, reply.data(), reply.size(), 0, (struct sockaddr*)&from, sizeof(from));
+    });
+  }
+}
+
+void OnSharedRequest(Session *session) {
+  SharedFrameRing &ring = *session->shared;
+  SharedFrameRing::ClearSignal(ring.GetRequestFd());
+  for(int i = 0; i < ring.GetSlotCount(); i++) {
+    SharedFrames::SlotHeader *slot = ring.GetSlot(i);
+    if(slot->state.load(std::memory_order_acquire) != SharedFrames::kRequest) continue;
+    slot->state.store(SharedFrames::kWorking, std::memory_order_relaxed);
+    cv::Size size = Infer(ring.GetFrame(i), slot->frameBytes, slot->format, slot->width, slot->height);
+    std::vector<uchar> body = BuildReply(size.width, size.height);
+    Later([&ring, slot, i, body] {
+      memcpy(ring.GetResult(i), body.data(), body.size());
+      slot->resultBytes = body.size();
+      slot->state.store(SharedFrames::kResult, std::memory_order_release);
+      ring.SignalResult();
+    });
+  }
+}
+
+// Take a shared ring for an existing session
+void OnHandshake(int listener) {
+  int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+  if(connection < 0) return;
+  SharedFrames::Handshake handshake{};
+  struct iovec payload{&handshake, sizeof(handshake)};
+  int fds[3] = {-1, -1, -1};
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  uchar accepted = 0;
+  if(recvmsg(connection, &message, 0) == sizeof(handshake)) {
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    if(rights && rights->cmsg_type == SCM_RIGHTS) memcpy(fds, CMSG_DATA(rights), sizeof(fds));
+    auto session = sessions.find(handshake.sessionId);
+    if(session != sessions.end() && fds[2] >= 0) {
+      auto ring = std::make_unique<SharedFrameRing>();
+      if(ring->Adopt(handshake, fds[0], fds[1], fds[2])) {
+        Session *owner = session->second.get();
+        owner->shared = std::move(ring);
+        reactor.Add(owner->shared->GetRequestFd(), [owner] { OnSharedRequest(owner); });
+        accepted = 1;
+        fds[0] = fds[1] = fds[2] = -1;
+        std::cout << "Session " << owner->id << " attached shared memory" << std::endl;
+      }
+    }
+  }
+  for(int fd : fds) {
+    if(fd >= 0) close(fd);
+  }
+  send(connection, &accepted, 1, 0);
+  close(connection);
+}
+
+void StartSession(std::vector<uchar> &reply) {
+  auto session = std::make_unique<Session>();
+  session->id = nextSessionId++;
+  session->sock = GetSocket();
+  struct sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t size = sizeof(address);
+  bind(session->sock, (struct sockaddr*)&address, size);
+  getsockname(session->sock, (struct sockaddr*)&address, &size);
+  session->port = ntohs(address.sin_port);
+
+  uint32_t anyAddress = 0;
+  reply.insert(reply.end(), (uchar*)&anyAddress, (uchar*)&anyAddress + 4);
+  reply.push_back(session->port >> 8);
+  reply.push_back(session->port & 0xff);
+  reply.insert(reply.end(), (uchar*)&session->id, (uchar*)&session->id + 4);
+
+  Session *owner = session.get();
+  reactor.Add(owner->sock, [owner] { OnSessionDatagram(owner); });
+  std::cout << "Started session " << owner->id << " on port " << owner->port << std::endl;
+  sessions[owner->id] = std::move(session);
+}
+
+void OnCommand() {
+  uchar buffer[1024];
+  struct sockaddr_in from;
+  socklen_t fromSize = sizeof(from);
+  int count;
+  while((count = recvfrom(commandSock, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&from, &fromSize)) > 0) {
+    fromSize = sizeof(from);
+    const size_t headerSize = sizeof(UdpSignature) + 2;
+    if(count < headerSize || memcmp(buffer, UdpSignature, sizeof(UdpSignature))) continue;
+    const uchar *signature = buffer + sizeof(UdpSignature);
+    std::vector<uchar> reply(buffer, buffer + headerSize);
+    if(!memcmp(signature, DiscoverSignature, 2)) {
+      // the header alone answers
+    } else if(!memcmp(signature, ModelListSignature, 2)) {
+      std::string models = "reefscape_v5,standin";
+      reply.push_back(models.size() >> 8);
+      reply.push_back(models.size() & 0xff);
+      reply.insert(reply.end(), models.begin(), models.end());
+    } else if(!memcmp(signature, SelectModelSignature, 2)) {
+      reply.push_back(1);
+    } else if(!memcmp(signature, StartSessionSignature, 2)) {
+      StartSession(reply);
+    } else if(!memcmp(signature, QuerySessionSignature, 2) && count >= headerSize + 4) {
+      uint32_t id;
+      memcpy(&id, buffer + headerSize, 4);
+      reply.push_back(sessions.count(id) ? 1 : 0);
+    } else {
+      continue;
+    }
+    sendto(commandSock, reply.data(), reply.size(), 0, (struct sockaddr*)&from, sizeof(from));
+  }
+}
+
+int main(int argc, char** argv) {
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if(arg == "--decode") {
+      decodeFrames = true;
+    } else if(arg == "--delay" && i + 1 < argc) {
+      inferenceDelayMs = std::stoi(argv[++i]);
+    } else {
+      std::cout << "Usage: frc_ledvision_periphery_standin [--decode] [--delay ms]" << std::endl;
+      return 1;
+    }
+  }
+
+  commandSock = GetSocket();
+  struct sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(CommandPort);
+  if(bind(commandSock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror("command bind error");
+    return 1;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  struct sockaddr_un local{};
+  local.sun_family = AF_UNIX;
+  memcpy(local.sun_path + 1, SharedFrames::SocketName, sizeof(SharedFrames::SocketName) - 1);
+  socklen_t localSize = offsetof(struct sockaddr_un, sun_path) + sizeof(SharedFrames::SocketName);
+  if(bind(listener, (struct sockaddr*)&local, localSize) < 0 || listen(listener, 8) < 0) {
+    perror("shared memory listener error");
+    return 1;
+  }
+
+  reactor.Add(commandSock, OnCommand);
+  reactor.Add(listener, [listener] { OnHandshake(listener); });
+  reactor.Start();
+  std::cout << "Periphery stand-in listening on port " << CommandPort << std::endl;
+
+  uint64_t lastAnswered = 0;
+  while(true) {
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    uint64_t answered = 0;
+    reactor.Invoke([&] { answered = framesAnswered; });
+    std::cout << "Answered " << answered - lastAnswered << " frames in 5 s" << std::endl;
+    lastAnswered = answered;
+  }
+}
@@ -0,0 +1,171 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <units/length.h>
+
+#include "Camera.h"
+#include "ReplayFrameSource.h"
+
+// Offline benchmark: runs recorded frames through the Camera pipeline and
+// reports throughput and per-stage latency without any camera hardware.
+//
+//   frc_ledvision_replay <image dir | mjpeg file | recording> [--realtime] [--fps N]
+//                        [--mode bgr|gray|gray2|gray4] [--tags 1,2,...] [--no-tracking]
+//                        [--cam N] [--run N] [--placement]
+//
+// A recording directory plays one camera's run, --cam defaults to the lowest
+// id and --run to the latest (0 is the oldest, negative counts back).
+// Threads run wherever the kernel puts them unless --placement pins them
+// like the robot executable does.
+
+using Clock = std::chrono::steady_clock;
+
+// Per-stage latencies of every labelled frame (ms)
+struct StageTimes {
+  std::string name;
+  std::vector<double> samples;
+};
+
+double Milliseconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+double Percentile(std::vector<double> &sorted, double fraction) {
+  if(sorted.empty()) return 0;
+  size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+  return sorted[index];
+}
+
+void Usage() {
+  std::cout << "Usage: frc_ledvision_replay <image dir | mjpeg file | recording> [--realtime] [--fps N]" << std::endl;
+  std::cout << "       [--mode bgr|gray|gray2|gray4] [--tags 1,2,...] [--no-tracking] [--cam N] [--run N] [--placement]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    Usage();
+    return 1;
+  }
+  std::string path = argv[1];
+  bool realTime = false;
+  bool tracking = true;
+  double fps = 30;
+  int replayCam = -1;
+  int replayRun = -1;
+  bool placement = false;
+  Camera::CaptureMode mode = Camera::CaptureMode::kBGR;
+  std::vector<uint8_t> targetTags;
+  for(int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value = i + 1 < argc ? argv[i + 1] : "";
+    if(arg == "--realtime") {
+      realTime = true;
+    } else if(arg == "--no-tracking") {
+      tracking = false;
+    } else if(arg == "--placement") {
+      placement = true;
+    } else if(arg == "--fps" && !value.empty()) {
+      fps = std::stod(value);
+      i++;
+    } else if(arg == "--cam" && !value.empty()) {
+      replayCam = std::stoi(value);
+      i++;
+    } else if(arg == "--run" && !value.empty()) {
+      replayRun = std::stoi(value);
+      i++;
+    } else if(arg == "--mode" && !value.empty()) {
+      if(value == "gray") mode = Camera::CaptureMode::kGray;
+      else if(value == "gray2") mode = Camera::CaptureMode::kGrayHalf;
+      else if(value == "gray4") mode = Camera::CaptureMode::kGrayQuarter;
+      i++;
+    } else if(arg == "--tags" && !value.empty()) {
+      std::stringstream list(value);
+      std::string tag;
+      while(std::getline(list, tag, ',')) targetTags.push_back(std::stoi(tag));
+      i++;
+    } else {
+      Usage();
+      return 1;
+    }
+  }
+
+  if(placement) ThreadPlacement::Configure(ThreadPlacement::DefaultPolicy());
+
+  auto frames = std::make_unique<ReplayFrameSource>(path, realTime, fps, replayCam, replayRun);
+  ReplayFrameSource *replay = frames.get();
+  size_t frameCount = replay->GetFrameCount();
+  if(!frameCount) {
+    std::cout << "No frames found in " << path << std::endl;
+    return 1;
+  }
+  cv::Size size = replay->GetFrameSize();
+  std::cout << "Replaying " << frameCount << " frames (" << size.width << "x" << size.height << ")" << (realTime ? " in real time" : "") << std::endl;
+
+  cs::VideoMode config{cs::VideoMode::PixelFormat::kMJPEG, size.width, size.height, (int)fps};
+  Camera cam{std::move(frames), config, {6.5_in, (double)640, (double)480, (double)320, (double)240}, mode};  // dummy numbers, same as main
+  if(!targetTags.empty()) cam.SetTargetTags(targetTags);
+  cam.SetTagTracking(tracking);
+
+  std::vector<StageTimes> stages = {{"grab"}, {"convert"}, {"detect"}, {"label"}, {"total"}};
+  size_t labelled = 0;
+  size_t tagsSeen = 0;
+  Clock::time_point first{};
+  Clock::time_point last{};
+  for(StageTimes &stage : stages) stage.samples.reserve(frameCount);
+
+  // Runs on the labeller thread, nothing else touches these until it's joined
+  cam.SetFrameCallback([&](Camera::Frame &frame) {
+    if(!labelled) first = frame.grabStarted;
+    last = frame.stageDone[Camera::kLabelled];
+    labelled++;
+    tagsSeen += frame.tags.size();
+    stages[0].samples.push_back(Milliseconds(frame.grabStarted, frame.stageDone[Camera::kCaptured]));
+    stages[1].samples.push_back(Milliseconds(frame.stageDone[Camera::kCaptured], frame.stageDone[Camera::kConverted]));
+    stages[2].samples.push_back(Milliseconds(frame.stageDone[Camera::kConverted], frame.stageDone[Camera::kProcessed]));
+    stages[3].samples.push_back(Milliseconds(frame.stageDone[Camera::kProcessed], frame.stageDone[Camera::kLabelled]));
+    stages[4].samples.push_back(Milliseconds(frame.grabStarted, frame.stageDone[Camera::kLabelled]));
+  });
+
+  cam.StartStream();
+
+  // Done once the source is empty and the last captured frame made it through labelling
+  uint64_t lastSeen = 0;
+  auto lastProgress = Clock::now();
+  while(true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t captured = cam.GetStageSeq(Camera::kCaptured);
+    uint64_t done = cam.GetStageSeq(Camera::kLabelled);
+    if(replay->Exhausted() && done >= captured) break;
+    if(done != lastSeen) {
+      lastSeen = done;
+      lastProgress = Clock::now();
+    } else if(Clock::now() - lastProgress > std::chrono::seconds(2)) {
+      std::cout << "Pipeline stalled, reporting what finished" << std::endl;
+      break;
+    }
+  }
+  cam.StopStream();
+
+  auto dropped = cam.GetDroppedFrames();
+  double seconds = Milliseconds(first, last) / 1000;
+  std::cout << "Labelled " << labelled << " of " << frameCount << " frames in " << seconds << " s ("
+            << (seconds > 0 ? labelled / seconds : 0) << " fps), " << tagsSeen << " tag detections" << std::endl;
+  std::cout << "Dropped: converter " << dropped.converter << ", processor " << dropped.processor
+            << ", labeller " << dropped.labeller << std::endl;
+  Camera::PoolStats pool = cam.GetPoolStats();
+  std::cout << "Pool: " << pool.highWater << " of " << pool.slots << " slots at most, exhausted "
+            << pool.exhausted << " times, " << pool.reallocations << " reallocations" << std::endl;
+
+  std::cout << "stage        p50      p90      p99      max  (ms)" << std::endl;
+  for(StageTimes &stage : stages) {
+    std::sort(stage.samples.begin(), stage.samples.end());
+    std::printf("%-8s %8.2f %8.2f %8.2f %8.2f\n", stage.name.c_str(),
+      Percentile(stage.samples, 0.5), Percentile(stage.samples, 0.9),
+      Percentile(stage.samples, 0.99), stage.samples.empty() ? 0 : stage.samples.back());
+  }
+  return 0;
+}